@@ -0,0 +1,52 @@
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include "omp.h"
+
+using std::cout;
+using std::endl;
+using std::chrono::high_resolution_clock;
+using std::chrono::duration_cast;
+using std::chrono::nanoseconds;
+
+// Measures the fork/join latency of an empty parallel region for team sizes
+// 1, 2, 4, ... up to the maximum number of threads.
+// usage: ./fork-join [regions per team size] [max threads]
+int main(int argc, char ** argv) {
+
+    int num_regions = 10000;
+    int max_threads = omp_get_max_threads();
+    if(argc > 1)
+        num_regions = atoi(argv[1]);
+    if(argc > 2)
+        max_threads = atoi(argv[2]);
+
+    volatile int sink = 0;
+
+    cout << "team size, regions, latency (us)" << endl;
+    for(int nt = 1; nt <= max_threads; nt *= 2) {
+        //warm up, the first region of a size may create the team
+#pragma omp parallel num_threads(nt)
+        {
+            sink = omp_get_thread_num();
+        }
+
+        auto t1 = high_resolution_clock::now();
+        for(int i = 0; i < num_regions; i++) {
+#pragma omp parallel num_threads(nt)
+            {
+                sink = omp_get_thread_num();
+            }
+        }
+        auto t2 = high_resolution_clock::now();
+
+        auto total = duration_cast<nanoseconds> (t2-t1).count();
+        cout << nt << ", " << num_regions << ", "
+             << total / 1000.0 / num_regions << endl;
+
+        if(nt < max_threads && nt * 2 > max_threads)
+            nt = max_threads / 2;
+    }
+
+    return 0;
+}
@@ -0,0 +1,56 @@
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include "omp.h"
+
+using std::cout;
+using std::endl;
+using std::chrono::high_resolution_clock;
+using std::chrono::duration_cast;
+using std::chrono::nanoseconds;
+
+// Measures the rate of cheap runtime calls inside a parallel region.
+// omp_get_thread_num is called directly. __kmpc_dispatch_next_4 is driven by
+// a schedule(dynamic, 1) loop over int, which clang lowers to one call per
+// iteration plus the final call that ends the loop.
+// usage: ./runtime-calls [calls per thread]
+int main(int argc, char ** argv) {
+
+    int num_calls = 10000000;
+    if(argc > 1)
+        num_calls = atoi(argv[1]);
+
+    int num_threads = 1;
+    long sink = 0;
+
+    auto t1 = high_resolution_clock::now();
+#pragma omp parallel reduction(+: sink)
+    {
+#pragma omp single
+        num_threads = omp_get_num_threads();
+        for(int i = 0; i < num_calls; i++) {
+            sink += omp_get_thread_num();
+        }
+    }
+    auto t2 = high_resolution_clock::now();
+    auto total = duration_cast<nanoseconds> (t2-t1).count();
+    double thread_num_rate = (double)num_calls * num_threads / (total / 1e9);
+
+    int iterations = num_calls;
+    t1 = high_resolution_clock::now();
+#pragma omp parallel for schedule(dynamic, 1) reduction(+: sink)
+    for(int i = 0; i < iterations; i++) {
+        sink += i & 1;
+    }
+    t2 = high_resolution_clock::now();
+    total = duration_cast<nanoseconds> (t2-t1).count();
+    double dispatch_rate = (double)iterations / (total / 1e9);
+
+    cout << "threads                        = " << num_threads << endl;
+    cout << "omp_get_thread_num calls/s     = " << thread_num_rate << endl;
+    cout << "__kmpc_dispatch_next_4 calls/s = " << dispatch_rate << endl;
+    if(sink == -1)
+        cout << sink << endl;
+
+    return 0;
+}
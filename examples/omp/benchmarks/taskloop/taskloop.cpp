@@ -0,0 +1,75 @@
+#include <iostream>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+
+using std::cout;
+using std::endl;
+
+// taskloop against a dynamically scheduled parallel for on the same loop
+
+double work(int i, int iters) {
+    double x = i;
+    for(int k = 0; k < iters; k++) {
+        x = std::sqrt(x + k);
+    }
+    return x;
+}
+
+int main(int argc, char **argv) {
+    int n = 100000;
+    int iters = 100;
+    int reps = 10;
+    int grainsize = 100;
+
+    if(argc > 1) {
+        n = atoi(argv[1]);
+    }
+    if(argc > 2) {
+        iters = atoi(argv[2]);
+    }
+    if(argc > 3) {
+        grainsize = atoi(argv[3]);
+    }
+    std::vector<double> a(n);
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for(int r = 0; r < reps; r++) {
+#pragma omp parallel for schedule(dynamic, grainsize)
+        for(int i = 0; i < n; i++) {
+            a[i] = work(i, iters);
+        }
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    auto for_time = std::chrono::duration_cast< std::chrono::microseconds >(end - start).count();
+
+    start = std::chrono::high_resolution_clock::now();
+    for(int r = 0; r < reps; r++) {
+#pragma omp parallel
+#pragma omp single
+#pragma omp taskloop grainsize(grainsize)
+        for(int i = 0; i < n; i++) {
+            a[i] = work(i, iters);
+        }
+    }
+    end = std::chrono::high_resolution_clock::now();
+    auto taskloop_time = std::chrono::duration_cast< std::chrono::microseconds >(end - start).count();
+
+    start = std::chrono::high_resolution_clock::now();
+    for(int r = 0; r < reps; r++) {
+#pragma omp parallel
+#pragma omp single
+#pragma omp taskloop
+        for(int i = 0; i < n; i++) {
+            a[i] = work(i, iters);
+        }
+    }
+    end = std::chrono::high_resolution_clock::now();
+    auto default_time = std::chrono::duration_cast< std::chrono::microseconds >(end - start).count();
+
+    cout << "parallel for dynamic(" << grainsize << ") = " << for_time / reps << " us" << endl;
+    cout << "taskloop grainsize(" << grainsize << ")     = " << taskloop_time / reps << " us" << endl;
+    cout << "taskloop                  = " << default_time / reps << " us" << endl;
+    return 0;
+}
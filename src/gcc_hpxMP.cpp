@@ -11,9 +11,10 @@
 #include <boost/shared_ptr.hpp>
 #include <iostream>
 #include <assert.h>
+#include <alloca.h>
 #include <hpx/assertion.hpp>
 
-extern boost::shared_ptr<hpx_runtime> hpx_backend;
+extern hpx_runtime *hpx_backend;
 
 void
 xexpand(KMP_API_NAME_GOMP_BARRIER)(void)
@@ -207,7 +208,8 @@ __kmp_GOMP_parallel_microtask_wrapper(int *gtid, int *npr,
     std::cout << "__kmp_GOMP_parallel_microtask_wrapper" << std::endl;
 #endif
     // Intialize the loop worksharing construct.
-    __kmpc_dispatch_init_8(nullptr, *gtid, schedule, start, end, incr, chunk_size);
+    //the outlined region stands for the loop, this runs on every thread
+    __kmp_dispatch_init_8(*gtid, (void const *) task, schedule, start, end, incr, chunk_size);
     // Now invoke the microtask.
     task(data);
 }
@@ -223,7 +225,7 @@ __kmp_GOMP_fork_call(void(*unwrapped_task)(void *), microtask_t wrapper, int arg
 #endif
     va_list ap;
     va_start(ap, argc);
-    vector<void*> argv(argc);
+    fork_args argv(argc);
 
     for( int i = 0; i < argc; i++ ){
         argv[i] = va_arg( ap, void * );
@@ -240,6 +242,7 @@ __kmp_GOMP_serialized_parallel(ident_t *loc, kmp_int32 gtid, void (*task)(void *
 #if defined DEBUG && defined HPXMP_HAVE_TRACE
     std::cout << "__kmp_GOMP_serialized_parallel" << std::endl;
 #endif
+    __kmpc_serialized_parallel(loc, gtid);
 }
 
 void
@@ -296,7 +299,8 @@ xexpand(KMP_API_NAME_GOMP_PARALLEL_END)(void) {
         int gtid = hpx_backend->get_thread_num();                              \
         if ((str > 0) ? (lb < ub) : (lb > ub))                                 \
         {                                                                      \
-            __kmpc_dispatch_init_8(nullptr, gtid, (schedule), lb,              \
+            __kmp_dispatch_init_8(gtid, __builtin_return_address(0),           \
+                (schedule), lb,                                                \
                 (str > 0) ? (ub - 1) : (ub + 1), str, chunk_sz);               \
             status = __kmpc_dispatch_next_8(nullptr, gtid, NULL,               \
                 (int64_t *) p_lb, (int64_t *) p_ub, (int64_t *) &stride);      \
@@ -321,7 +325,8 @@ xexpand(KMP_API_NAME_GOMP_PARALLEL_END)(void) {
         int gtid = hpx_backend->get_thread_num();                              \
         if ((str > 0) ? (lb < ub) : (lb > ub))                                 \
         {                                                                      \
-            __kmpc_dispatch_init_8(nullptr, gtid, (schedule), lb,              \
+            __kmp_dispatch_init_8(gtid, __builtin_return_address(0),           \
+                (schedule), lb,                                                \
                 (str > 0) ? (ub - 1) : (ub + 1), str, chunk_sz);               \
             status = __kmpc_dispatch_next_8(nullptr, gtid, NULL,               \
                 (int64_t *) p_lb, (int64_t *) p_ub, (int64_t *) &stride);      \
@@ -360,6 +365,8 @@ LOOP_START(xexpand(KMP_API_NAME_GOMP_LOOP_GUIDED_START), kmp_sch_guided_chunked)
 LOOP_NEXT(xexpand(KMP_API_NAME_GOMP_LOOP_GUIDED_NEXT), {})
 LOOP_RUNTIME_START(xexpand(KMP_API_NAME_GOMP_LOOP_RUNTIME_START), kmp_sch_runtime)
 LOOP_NEXT(xexpand(KMP_API_NAME_GOMP_LOOP_RUNTIME_NEXT), {})
+LOOP_START(xexpand(KMP_API_NAME_GOMP_LOOP_NONMONOTONIC_DYNAMIC_START), kmp_sch_static_steal)
+LOOP_NEXT(xexpand(KMP_API_NAME_GOMP_LOOP_NONMONOTONIC_DYNAMIC_NEXT), {})
 
 LOOP_START(xexpand(KMP_API_NAME_GOMP_LOOP_ORDERED_STATIC_START), kmp_ord_static)
 LOOP_NEXT(xexpand(KMP_API_NAME_GOMP_LOOP_ORDERED_STATIC_NEXT), \
@@ -445,7 +452,8 @@ xexpand(KMP_API_NAME_GOMP_LOOP_END_NOWAIT)(void) {
         int gtid = hpx_backend->get_thread_num();                              \
         if ((str > 0) ? (lb < ub) : (lb > ub))                                 \
         {                                                                      \
-            __kmpc_dispatch_init_8u(nullptr, gtid, (schedule), lb,             \
+            __kmp_dispatch_init_8u(gtid, __builtin_return_address(0),          \
+                (schedule), lb,                                                \
                 (str > 0) ? (ub - 1) : (ub + 1), str, chunk_sz);               \
             status = __kmpc_dispatch_next_8u(nullptr, gtid, NULL,              \
                 (uint64_t *) p_lb, (uint64_t *) p_ub, (int64_t *) &stride);    \
@@ -473,7 +481,8 @@ xexpand(KMP_API_NAME_GOMP_LOOP_END_NOWAIT)(void) {
         int gtid = hpx_backend->get_thread_num();                              \
         if ((str > 0) ? (lb < ub) : (lb > ub))                                 \
         {                                                                      \
-            __kmpc_dispatch_init_8u(nullptr, gtid, (schedule), lb,             \
+            __kmp_dispatch_init_8u(gtid, __builtin_return_address(0),          \
+                (schedule), lb,                                                \
                 (str > 0) ? (ub - 1) : (ub + 1), str, chunk_sz);               \
             status = __kmpc_dispatch_next_8u(nullptr, gtid, NULL,              \
                 (uint64_t *) p_lb, (uint64_t *) p_ub, (int64_t *) &stride);    \
@@ -512,6 +521,8 @@ LOOP_START_ULL(xexpand(KMP_API_NAME_GOMP_LOOP_ULL_GUIDED_START), kmp_sch_guided_
 LOOP_NEXT_ULL(xexpand(KMP_API_NAME_GOMP_LOOP_ULL_GUIDED_NEXT), {})
 LOOP_RUNTIME_START_ULL(xexpand(KMP_API_NAME_GOMP_LOOP_ULL_RUNTIME_START), kmp_sch_runtime)
 LOOP_NEXT_ULL(xexpand(KMP_API_NAME_GOMP_LOOP_ULL_RUNTIME_NEXT), {})
+LOOP_START_ULL(xexpand(KMP_API_NAME_GOMP_LOOP_ULL_NONMONOTONIC_DYNAMIC_START), kmp_sch_static_steal)
+LOOP_NEXT_ULL(xexpand(KMP_API_NAME_GOMP_LOOP_ULL_NONMONOTONIC_DYNAMIC_NEXT), {})
 
 LOOP_START_ULL(xexpand(KMP_API_NAME_GOMP_LOOP_ULL_ORDERED_STATIC_START), kmp_ord_static)
 LOOP_NEXT_ULL(xexpand(KMP_API_NAME_GOMP_LOOP_ULL_ORDERED_STATIC_NEXT), \
@@ -553,19 +564,46 @@ PARALLEL_LOOP_START(xexpand(KMP_API_NAME_GOMP_PARALLEL_LOOP_RUNTIME_START),
 // Tasking constructs
 //
 
-void
-xexpand(KMP_API_NAME_GOMP_TASK)(void (*func)(void *), void *data, void (*copy_func)(void *, void *),
-                                long arg_size, long arg_align, bool if_cond, unsigned gomp_flags,void **depend) {
-#if defined DEBUG && defined HPXMP_HAVE_TRACE
-    std::cout << "KMP_API_NAME_GOMP_TASK" << std::endl;
-#endif
-    start_backend();
-    int gtid = hpx_backend->get_thread_num();
+// gcc passes the number of dependences and the number of out ones among
+// them, followed by the addresses with the out ones first. Since gcc 9 the
+// count may be zero, followed by the total and the number of out/inout,
+// mutexinoutset and in dependences.
+static vector<kmp_depend_info_t>
+gomp_depend_list(void **depend) {
+    size_t ndeps = (kmp_intptr_t) depend[0];
+    size_t nout = (kmp_intptr_t) depend[1];
+    size_t first = 2;
+    if (ndeps == 0) {
+        ndeps = (kmp_intptr_t) depend[1];
+        //mutexinoutset is treated like out
+        nout = (kmp_intptr_t) depend[2] + (kmp_intptr_t) depend[3];
+        first = 5;
+    }
+    vector<kmp_depend_info_t> dep_list(ndeps);
+    for (size_t i = 0U; i < ndeps; i++) {
+        dep_list[i].base_addr = (kmp_intptr_t) depend[first + i];
+        dep_list[i].len = 0U;
+        dep_list[i].flags.in = 1;
+        dep_list[i].flags.out = (i < nout);
+    }
+    return dep_list;
+}
 
+// a task descriptor holding a copy of the argument block of a gcc task
+static kmp_task_t *
+gomp_alloc_task(int gtid, void (*func)(void *), void *data, void (*copy_func)(void *, void *),
+                long arg_size, long arg_align, unsigned gomp_flags, int priority) {
     kmp_task_t *task = __kmpc_omp_task_alloc(nullptr, gtid, 0,
                                              sizeof(kmp_task_t), arg_size ? arg_size + arg_align - 1 : 0,
                                              (kmp_routine_entry_t) func);
-    task->gcc = true;
+    kmp_task_header_t *header = task_header(task);
+    header->gcc = true;
+    header->final = (gomp_flags & gomp_task_final) != 0;
+    header->untied = (gomp_flags & gomp_task_untied) != 0;
+    if (gomp_flags & gomp_task_priority) {
+        header->has_priority = true;
+        task->data2.priority = priority;
+    }
     if (arg_size > 0) {
         if (arg_align > 0) {
             task->shareds = (void *) ((((size_t) task->shareds)
@@ -577,30 +615,63 @@ xexpand(KMP_API_NAME_GOMP_TASK)(void (*func)(void *), void *data, void (*copy_fu
             memcpy(task->shareds, data, arg_size);
         }
     }
-    if (if_cond) {
-        if (gomp_flags & 8) {
-            const size_t ndeps = (kmp_intptr_t) depend[0];
-            const size_t nout = (kmp_intptr_t) depend[1];
-            vector<kmp_depend_info_t> dep_list;
-            dep_list.reserve(ndeps);
-
-            for (size_t i = 0U; i < ndeps; i++) {
-                dep_list[i].base_addr = (kmp_intptr_t) depend[2U + i];
-                dep_list[i].len = 0U;
-                dep_list[i].flags.in = 1;
-                dep_list[i].flags.out = (i < nout);
-            }
-            __kmpc_omp_task_with_deps(nullptr, gtid, task, ndeps, &dep_list[0], 0, NULL);
-        } else {
-            __kmpc_omp_task(nullptr, gtid, task);
+    return task;
+}
+
+void
+xexpand(KMP_API_NAME_GOMP_TASK)(void (*func)(void *), void *data, void (*copy_func)(void *, void *),
+                                long arg_size, long arg_align, bool if_cond, unsigned gomp_flags,void **depend,
+                                int priority) {
+#if defined DEBUG && defined HPXMP_HAVE_TRACE
+    std::cout << "KMP_API_NAME_GOMP_TASK" << std::endl;
+#endif
+    start_backend();
+    int gtid = hpx_backend->get_thread_num();
+    omp_task_data *parent = hpx_backend->current_task();
+
+    //undeferred and included tasks run right here, without a task descriptor
+    if (!if_cond || parent->final_task) {
+        taskgraph_not_replayable(parent);
+        if (gomp_flags & gomp_task_depend) {
+            vector<kmp_depend_info_t> dep_list = gomp_depend_list(depend);
+            hpx_backend->wait_deps(gtid, dep_list.size(), dep_list.data(), 0, nullptr);
         }
-    }else {
-            __kmpc_omp_task_begin_if0(nullptr, gtid, task);
+        bool final = parent->final_task || (gomp_flags & gomp_task_final);
+        //a mergeable task may share the data environment of its parent,
+        // unless it would make the parent final
+        bool merged = (gomp_flags & gomp_task_mergeable) && final == parent->final_task;
+        intrusive_ptr<omp_task_data> task_data;
+        omp_task_data *encountering = nullptr;
+        if (!merged) {
+            task_data.reset(new omp_task_data(gtid, parent->team, parent->icv));
+            task_data->final_task = final;
+            encountering = exchange_current_task(task_data.get());
+        }
+        if (copy_func) {
+            long align = arg_align > 0 ? arg_align : 1;
+            char *buf = (char *) alloca(arg_size + align - 1);
+            char *arg = (char *) (((size_t) buf + align - 1) / align * align);
+            (*copy_func)(arg, data);
+            func(arg);
+        } else {
             func(data);
-            __kmpc_omp_task_complete_if0(nullptr, gtid, task);
         }
+        if (!merged) {
+            exchange_current_task(encountering);
+        }
+        return;
     }
 
+    kmp_task_t *task = gomp_alloc_task(gtid, func, data, copy_func, arg_size, arg_align,
+                                       gomp_flags, priority);
+    if (gomp_flags & gomp_task_depend) {
+        vector<kmp_depend_info_t> dep_list = gomp_depend_list(depend);
+        __kmpc_omp_task_with_deps(nullptr, gtid, task, dep_list.size(), dep_list.data(), 0, NULL);
+    } else {
+        __kmpc_omp_task(nullptr, gtid, task);
+    }
+}
+
 
 void
 xexpand(KMP_API_NAME_GOMP_TASKWAIT)(void)
@@ -611,6 +682,104 @@ xexpand(KMP_API_NAME_GOMP_TASKWAIT)(void)
     __kmpc_omp_taskwait(nullptr, 0);
 }
 
+void
+xexpand(KMP_API_NAME_GOMP_TASKWAIT_DEPEND)(void **depend)
+{
+#if defined DEBUG && defined HPXMP_HAVE_TRACE
+    std::cout << "KMP_API_NAME_GOMP_TASKWAIT_DEPEND" << std::endl;
+#endif
+    start_backend();
+    vector<kmp_depend_info_t> dep_list = gomp_depend_list(depend);
+    hpx_backend->wait_deps(hpx_backend->get_thread_num(), dep_list.size(), dep_list.data(), 0, nullptr);
+}
+
+// gcc puts the bounds of a chunk into the first two words of its argument
+// block, the upper one exclusive. The argument block is only valid during
+// the call and may need copy_func, so all chunks are created here rather than
+// split up by tasks.
+template <typename T>
+static void
+gomp_taskloop(void (*func)(void *), void *data, void (*copy_func)(void *, void *),
+              long arg_size, long arg_align, unsigned gomp_flags, unsigned long num_tasks,
+              int priority, T start, T end, T step) {
+    start_backend();
+    int gtid = hpx_backend->get_thread_num();
+
+    unsigned long long n;
+    if (gomp_flags & gomp_task_up) {
+        if (start >= end)
+            return;
+        n = (end - start + step - 1) / step;
+    } else {
+        if (start <= end)
+            return;
+        n = (start - end - step - 1) / -step;
+    }
+
+    unsigned long long grainsize, extras;
+    if (gomp_flags & gomp_task_grainsize) {
+        //num_tasks holds the grainsize
+        grainsize = num_tasks ? num_tasks : 1;
+        num_tasks = n / grainsize;
+        if (num_tasks == 0)
+            num_tasks = 1;
+    } else {
+        if (num_tasks == 0)
+            num_tasks = hpx_backend->get_num_threads();
+        if (num_tasks > n)
+            num_tasks = n;
+    }
+    grainsize = n / num_tasks;
+    extras = n % num_tasks;
+
+    if (!(gomp_flags & gomp_task_nogroup)) {
+        __kmpc_taskgroup(nullptr, gtid);
+    }
+    omp_task_data *parent = hpx_backend->current_task();
+    T lower = start;
+    for (unsigned long c = 0; c < num_tasks; c++) {
+        T count = grainsize + (c < extras ? 1 : 0);
+        T upper = lower + count * step;
+        kmp_task_t *task = gomp_alloc_task(gtid, func, data, copy_func, arg_size, arg_align,
+                                           gomp_flags, priority);
+        ((T *) task->shareds)[0] = lower;
+        ((T *) task->shareds)[1] = upper;
+        if (gomp_flags & gomp_task_if) {
+            __kmpc_omp_task(nullptr, gtid, task);
+        } else {
+            execute_task_inline(gtid, task, parent);
+            free_task(task);
+        }
+        lower = upper;
+    }
+    if (!(gomp_flags & gomp_task_nogroup)) {
+        __kmpc_end_taskgroup(nullptr, gtid);
+    }
+}
+
+void
+xexpand(KMP_API_NAME_GOMP_TASKLOOP)(void (*func)(void *), void *data, void (*copy_func)(void *, void *),
+                                    long arg_size, long arg_align, unsigned gomp_flags,
+                                    unsigned long num_tasks, int priority, long start, long end, long step) {
+#if defined DEBUG && defined HPXMP_HAVE_TRACE
+    std::cout << "KMP_API_NAME_GOMP_TASKLOOP" << std::endl;
+#endif
+    gomp_taskloop<long>(func, data, copy_func, arg_size, arg_align, gomp_flags,
+                        num_tasks, priority, start, end, step);
+}
+
+void
+xexpand(KMP_API_NAME_GOMP_TASKLOOP_ULL)(void (*func)(void *), void *data, void (*copy_func)(void *, void *),
+                                        long arg_size, long arg_align, unsigned gomp_flags,
+                                        unsigned long num_tasks, int priority, unsigned long long start,
+                                        unsigned long long end, unsigned long long step) {
+#if defined DEBUG && defined HPXMP_HAVE_TRACE
+    std::cout << "KMP_API_NAME_GOMP_TASKLOOP_ULL" << std::endl;
+#endif
+    gomp_taskloop<unsigned long long>(func, data, copy_func, arg_size, arg_align, gomp_flags,
+                                      num_tasks, priority, start, end, step);
+}
+
 //
 // Sections worksharing constructs
 //
@@ -700,9 +869,16 @@ xexpand(KMP_API_NAME_GOMP_PARALLEL)(void (*task)(void *), void *data, unsigned n
 #endif
     start_backend();
     //__kmpc_push_num_threads
-    auto my_data = hpx_backend->get_task_data();
+    omp_task_data *my_data = hpx_backend->current_task();
     my_data->set_threads_requested(num_threads);
 
+    //gcc passes num_threads 1 for if(0) regions
+    if(my_data->threads_requested == 1) {
+        __kmp_GOMP_serialized_parallel(nullptr, 0, task);
+        task(data);
+        __kmpc_end_serialized_parallel(nullptr, 0);
+        return;
+    }
     __kmp_GOMP_fork_call(task,(microtask_t )__kmp_GOMP_microtask_wrapper, 2, task, data);
 }
 
@@ -716,7 +892,7 @@ xexpand(KMP_API_NAME_GOMP_PARALLEL_SECTIONS)(void (*task) (void *), void *data,
     //from gomp parallel
     start_backend();
     //from __kmpc_push_num_threads
-    auto my_data = hpx_backend->get_task_data();
+    omp_task_data *my_data = hpx_backend->current_task();
     my_data->set_threads_requested(num_threads);
 
     __kmp_GOMP_fork_call(task,
@@ -732,7 +908,7 @@ xexpand(KMP_API_NAME_GOMP_PARALLEL_SECTIONS)(void (*task) (void *), void *data,
         long ub, long str, long chunk_sz, unsigned flags)                      \
     {                                                                          \
         start_backend();                                                       \
-        auto my_data = hpx_backend->get_task_data();                 \
+        omp_task_data *my_data = hpx_backend->current_task();                  \
         my_data->set_threads_requested(num_threads);                           \
         __kmp_GOMP_fork_call(task,                                             \
             (microtask_t) __kmp_GOMP_parallel_microtask_wrapper, 9, task,      \
@@ -995,6 +1171,17 @@ xaliasify(KMP_API_NAME_GOMP_TARGET_END_DATA, 40);
 xaliasify(KMP_API_NAME_GOMP_TARGET_UPDATE, 40);
 xaliasify(KMP_API_NAME_GOMP_TEAMS, 40);
 
+// GOMP_4.5 aliases
+xaliasify(KMP_API_NAME_GOMP_TASKLOOP, 45);
+xaliasify(KMP_API_NAME_GOMP_TASKLOOP_ULL, 45);
+xaliasify(KMP_API_NAME_GOMP_LOOP_NONMONOTONIC_DYNAMIC_START, 45);
+xaliasify(KMP_API_NAME_GOMP_LOOP_NONMONOTONIC_DYNAMIC_NEXT, 45);
+xaliasify(KMP_API_NAME_GOMP_LOOP_ULL_NONMONOTONIC_DYNAMIC_START, 45);
+xaliasify(KMP_API_NAME_GOMP_LOOP_ULL_NONMONOTONIC_DYNAMIC_NEXT, 45);
+
+// GOMP_5.0 aliases
+xaliasify(KMP_API_NAME_GOMP_TASKWAIT_DEPEND, 50);
+
 
 // GOMP_1.0 versioned symbols
 xversionify(KMP_API_NAME_GOMP_ATOMIC_END, 10, "GOMP_1.0");
@@ -1079,3 +1266,12 @@ xversionify(KMP_API_NAME_GOMP_TARGET_DATA, 40, "GOMP_4.0");
 xversionify(KMP_API_NAME_GOMP_TARGET_END_DATA, 40, "GOMP_4.0");
 xversionify(KMP_API_NAME_GOMP_TARGET_UPDATE, 40, "GOMP_4.0");
 xversionify(KMP_API_NAME_GOMP_TEAMS, 40, "GOMP_4.0");
+
+xversionify(KMP_API_NAME_GOMP_TASKLOOP, 45, "GOMP_4.5");
+xversionify(KMP_API_NAME_GOMP_TASKLOOP_ULL, 45, "GOMP_4.5");
+xversionify(KMP_API_NAME_GOMP_LOOP_NONMONOTONIC_DYNAMIC_START, 45, "GOMP_4.5");
+xversionify(KMP_API_NAME_GOMP_LOOP_NONMONOTONIC_DYNAMIC_NEXT, 45, "GOMP_4.5");
+xversionify(KMP_API_NAME_GOMP_LOOP_ULL_NONMONOTONIC_DYNAMIC_START, 45, "GOMP_4.5");
+xversionify(KMP_API_NAME_GOMP_LOOP_ULL_NONMONOTONIC_DYNAMIC_NEXT, 45, "GOMP_4.5");
+
+xversionify(KMP_API_NAME_GOMP_TASKWAIT_DEPEND, 50, "GOMP_5.0");
@@ -8,6 +8,20 @@
 
 #include "kmp_ftn_os.h"
 
+// flags passed to GOMP_task
+enum gomp_task_flags {
+    gomp_task_untied = 1,
+    gomp_task_final = 2,
+    gomp_task_mergeable = 4,
+    gomp_task_depend = 8,
+    gomp_task_priority = 1 << 4,
+    // taskloop only
+    gomp_task_up = 1 << 8,
+    gomp_task_grainsize = 1 << 9,
+    gomp_task_if = 1 << 10,
+    gomp_task_nogroup = 1 << 11
+};
+
 typedef enum kmp_cancel_kind_t {
     cancel_noreq = 0,
     cancel_parallel = 1,
@@ -20,9 +34,21 @@ extern "C" void
 xexpand(KMP_API_NAME_GOMP_PARALLEL)(void (*task)(void *), void *data, unsigned num_threads, unsigned int flags);
 extern "C" void 
 xexpand(KMP_API_NAME_GOMP_TASK)(void (*func)(void *), void *data, void (*copy_func)(void *, void *),
-                                long arg_size, long arg_align, bool if_cond, unsigned gomp_flags, void **depend);
+                                long arg_size, long arg_align, bool if_cond, unsigned gomp_flags, void **depend,
+                                int priority);
 extern "C" void
 xexpand(KMP_API_NAME_GOMP_TASKWAIT)(void);
+extern "C" void
+xexpand(KMP_API_NAME_GOMP_TASKWAIT_DEPEND)(void **depend);
+extern "C" void
+xexpand(KMP_API_NAME_GOMP_TASKLOOP)(void (*func)(void *), void *data, void (*copy_func)(void *, void *),
+                                    long arg_size, long arg_align, unsigned gomp_flags,
+                                    unsigned long num_tasks, int priority, long start, long end, long step);
+extern "C" void
+xexpand(KMP_API_NAME_GOMP_TASKLOOP_ULL)(void (*func)(void *), void *data, void (*copy_func)(void *, void *),
+                                        long arg_size, long arg_align, unsigned gomp_flags,
+                                        unsigned long num_tasks, int priority, unsigned long long start,
+                                        unsigned long long end, unsigned long long step);
 
 extern "C" int
 xexpand(KMP_API_NAME_GOMP_SINGLE_START)(void);
@@ -66,6 +92,7 @@ xexpand(KMP_API_NAME_GOMP_ORDERED_END)(void);
 DECLEAR_LOOP_START(xexpand(KMP_API_NAME_GOMP_LOOP_STATIC_START))
 DECLEAR_LOOP_START(xexpand(KMP_API_NAME_GOMP_LOOP_DYNAMIC_START))
 DECLEAR_LOOP_START(xexpand(KMP_API_NAME_GOMP_LOOP_GUIDED_START))
+DECLEAR_LOOP_START(xexpand(KMP_API_NAME_GOMP_LOOP_NONMONOTONIC_DYNAMIC_START))
 DECLEAR_LOOP_START(xexpand(KMP_API_NAME_GOMP_LOOP_ORDERED_STATIC_START))
 DECLEAR_LOOP_START(xexpand(KMP_API_NAME_GOMP_LOOP_ORDERED_DYNAMIC_START))
 DECLEAR_LOOP_START(xexpand(KMP_API_NAME_GOMP_LOOP_ORDERED_GUIDED_START))
@@ -81,6 +108,7 @@ DECLEAR_LOOP_NEXT(xexpand(KMP_API_NAME_GOMP_LOOP_STATIC_NEXT))
 DECLEAR_LOOP_NEXT(xexpand(KMP_API_NAME_GOMP_LOOP_DYNAMIC_NEXT))
 DECLEAR_LOOP_NEXT(xexpand(KMP_API_NAME_GOMP_LOOP_GUIDED_NEXT))
 DECLEAR_LOOP_NEXT(xexpand(KMP_API_NAME_GOMP_LOOP_RUNTIME_NEXT))
+DECLEAR_LOOP_NEXT(xexpand(KMP_API_NAME_GOMP_LOOP_NONMONOTONIC_DYNAMIC_NEXT))
 DECLEAR_LOOP_NEXT(xexpand(KMP_API_NAME_GOMP_LOOP_ORDERED_STATIC_NEXT))
 DECLEAR_LOOP_NEXT(xexpand(KMP_API_NAME_GOMP_LOOP_ORDERED_DYNAMIC_NEXT))
 DECLEAR_LOOP_NEXT(xexpand(KMP_API_NAME_GOMP_LOOP_ORDERED_GUIDED_NEXT))
@@ -94,6 +122,7 @@ DECLEAR_LOOP_NEXT(xexpand(KMP_API_NAME_GOMP_LOOP_ORDERED_RUNTIME_NEXT))
 DECLEAR_LOOP_START_ULL(xexpand(KMP_API_NAME_GOMP_LOOP_ULL_STATIC_START))
 DECLEAR_LOOP_START_ULL(xexpand(KMP_API_NAME_GOMP_LOOP_ULL_DYNAMIC_START))
 DECLEAR_LOOP_START_ULL(xexpand(KMP_API_NAME_GOMP_LOOP_ULL_GUIDED_START))
+DECLEAR_LOOP_START_ULL(xexpand(KMP_API_NAME_GOMP_LOOP_ULL_NONMONOTONIC_DYNAMIC_START))
 DECLEAR_LOOP_START_ULL(xexpand(KMP_API_NAME_GOMP_LOOP_ULL_ORDERED_STATIC_START))
 DECLEAR_LOOP_START_ULL(xexpand(KMP_API_NAME_GOMP_LOOP_ULL_ORDERED_DYNAMIC_START))
 DECLEAR_LOOP_START_ULL(xexpand(KMP_API_NAME_GOMP_LOOP_ULL_ORDERED_GUIDED_START))
@@ -110,6 +139,7 @@ DECLEAR_LOOP_NEXT_ULL(xexpand(KMP_API_NAME_GOMP_LOOP_ULL_STATIC_NEXT))
 DECLEAR_LOOP_NEXT_ULL(xexpand(KMP_API_NAME_GOMP_LOOP_ULL_DYNAMIC_NEXT))
 DECLEAR_LOOP_NEXT_ULL(xexpand(KMP_API_NAME_GOMP_LOOP_ULL_GUIDED_NEXT))
 DECLEAR_LOOP_NEXT_ULL(xexpand(KMP_API_NAME_GOMP_LOOP_ULL_RUNTIME_NEXT))
+DECLEAR_LOOP_NEXT_ULL(xexpand(KMP_API_NAME_GOMP_LOOP_ULL_NONMONOTONIC_DYNAMIC_NEXT))
 DECLEAR_LOOP_NEXT_ULL(xexpand(KMP_API_NAME_GOMP_LOOP_ULL_ORDERED_STATIC_NEXT))
 DECLEAR_LOOP_NEXT_ULL(xexpand(KMP_API_NAME_GOMP_LOOP_ULL_ORDERED_DYNAMIC_NEXT))
 DECLEAR_LOOP_NEXT_ULL(xexpand(KMP_API_NAME_GOMP_LOOP_ULL_ORDERED_GUIDED_NEXT))
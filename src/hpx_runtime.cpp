@@ -15,6 +15,10 @@
 #include <hpx/runtime/threads/run_as_hpx_thread.hpp>
 #include <hpx/program_options/options_description.hpp>
 
+#include <algorithm>
+#include <cctype>
+#include <string>
+
 using std::cout;
 using std::endl;
 
@@ -26,7 +30,7 @@ using hpx::threads::get_thread_data;
 using hpx::threads::get_self_id;
 
 
-extern boost::shared_ptr<hpx_runtime> hpx_backend;
+extern hpx_runtime *hpx_backend;
 
 
 void wait_for_startup(std::mutex& startup_mtx, std::condition_variable& cond, bool& running)
@@ -49,7 +53,10 @@ void fini_runtime()
 #endif
     std::this_thread::sleep_for(std::chrono::milliseconds(50));
     //this should only be done if this runtime started hpx
-    hpx::threads::run_as_hpx_thread([]() { hpx_backend.reset(); });
+    hpx::threads::run_as_hpx_thread([]() {
+        delete hpx_backend;
+        hpx_backend = nullptr;
+    });
     hpx::threads::run_as_hpx_thread([]() { hpx::finalize(); });
     hpx::stop();
 #if defined DEBUG
@@ -141,17 +148,560 @@ hpx_runtime::hpx_runtime()
     implicit_region.reset(new parallel_region(1));
     initial_thread.reset(new omp_task_data(implicit_region.get(), &device_icv, initial_num_threads));
     walltime.reset(new high_resolution_timer);
+    env_init();
 
     if(!external_hpx) {
         start_hpx(initial_num_threads);
     }
+    task_allocator::get_instance().init(hpx::get_os_thread_count());
+    throttle.init(hpx::get_os_thread_count(), use_task_throttle ? task_inflight_limit : 0);
+    num_serialized_caches = hpx::get_os_thread_count() + 1;
+    serialized_cache = make_aligned_array<serialized_teams>(num_serialized_caches);
+}
+
+// Must run on an hpx thread, parked hot team workers and the fork handoff
+// are shut down here so that hpx::finalize does not wait on them.
+hpx_runtime::~hpx_runtime()
+{
+    vector<shared_ptr<hot_team>> teams;
+    shared_ptr<fork_handoff> handoff;
+    {
+        std::lock_guard<mutex_type> l(hot_team_mtx);
+        teams.swap(hot_teams);
+        handoff.swap(external_fork);
+    }
+    teams.clear();
+    handoff.reset();
+    if(task_alloc_stats) {
+        task_allocator::get_instance().print_stats(std::cerr);
+        std::cerr << "hpxMP task context: " << sizeof(omp_task_data)
+                  << " bytes per task, " << sizeof(omp_task_ext)
+                  << " more once it has children, dependences or a taskgroup"
+                  << endl;
+    }
+}
+
+// OMP_SCHEDULE is [modifier:]kind[,chunk], kind one of static, dynamic,
+// guided, auto or static_steal. A nonmonotonic dynamic schedule steals.
+// Anything else leaves the ICV alone.
+static void parse_schedule(char const *value, omp_icv &icv)
+{
+    std::string text;
+    for(char const *c = value; *c; c++) {
+        if(!isspace(static_cast<unsigned char>(*c))) {
+            text += static_cast<char>(tolower(static_cast<unsigned char>(*c)));
+        }
+    }
+    std::string modifier;
+    std::string::size_type colon = text.find(':');
+    if(colon != std::string::npos) {
+        modifier = text.substr(0, colon);
+        text.erase(0, colon + 1);
+    }
+    int chunk = 0;
+    std::string::size_type comma = text.find(',');
+    if(comma != std::string::npos) {
+        chunk = std::max(atoi(text.c_str() + comma + 1), 0);
+        text.erase(comma);
+    }
+
+    int kind;
+    if(text == "static") {
+        kind = omp_sched_static;
+    } else if(text == "dynamic") {
+        kind = omp_sched_dynamic;
+        if(modifier == "nonmonotonic") {
+            kind |= omp_sched_nonmonotonic;
+        }
+    } else if(text == "guided") {
+        kind = omp_sched_guided;
+    } else if(text == "auto") {
+        kind = omp_sched_auto;
+    } else if(text == "static_steal") {
+        kind = omp_sched_static_steal;
+    } else {
+        return;
+    }
+    if(modifier == "monotonic") {
+        kind |= omp_sched_monotonic;
+    }
+    icv.run_sched = kind;
+    icv.run_sched_chunk = chunk;
+}
+
+void hpx_runtime::env_init()
+{
+    char const* hot_teams_env = getenv("OMP_HPX_HOT_TEAMS");
+    if(hot_teams_env != NULL) {
+        use_hot_teams = atoi(hot_teams_env) != 0;
+    }
+    //The application owns the hpx runtime and decides when it stops,
+    // workers parked past that point would keep hpx::finalize waiting.
+    if(external_hpx) {
+        use_hot_teams = false;
+    }
+    char const* max_level = getenv("OMP_HPX_HOT_TEAMS_MAX_LEVEL");
+    if(max_level != NULL) {
+        hot_teams_max_level = std::max(atoi(max_level), 0);
+    }
+    //in microseconds
+    char const* spin = getenv("OMP_HPX_SPIN_TIME");
+    if(spin != NULL) {
+        spin_time = std::max(atoll(spin), 0ll);
+    }
+    //teams of at least this size are spawned as a tree
+    char const* tree_threshold = getenv("OMP_HPX_TREE_FORK_THRESHOLD");
+    if(tree_threshold != NULL) {
+        tree_fork_threshold = std::max(atoi(tree_threshold), 2);
+    }
+    char const* tree_fanout = getenv("OMP_HPX_TREE_FORK_FANOUT");
+    if(tree_fanout != NULL) {
+        tree_fork_fanout = std::max(atoi(tree_fanout), 2);
+    }
+    if(use_hot_teams) {
+        hot_teams.resize(hot_teams_max_level);
+    }
+    char const* critical_path_env = getenv("OMP_HPX_CRITICAL_PATH");
+    if(critical_path_env != NULL) {
+        critical_path_priority = atoi(critical_path_env) != 0;
+    }
+    char const* task_throttle_env = getenv("OMP_HPX_TASK_THROTTLE");
+    if(task_throttle_env != NULL) {
+        use_task_throttle = atoi(task_throttle_env) != 0;
+    }
+    //deferred and unfinished tasks per worker
+    char const* inflight_limit = getenv("OMP_HPX_TASK_INFLIGHT_LIMIT");
+    if(inflight_limit != NULL) {
+        task_inflight_limit = std::max(atoll(inflight_limit), 1ll);
+    }
+    char const* max_task_priority = getenv("OMP_MAX_TASK_PRIORITY");
+    if(max_task_priority != NULL) {
+        device_icv.max_task_priority = std::max(atoi(max_task_priority), 0);
+    }
+    char const* alloc_stats = getenv("OMP_HPX_TASK_ALLOC_STATS");
+    if(alloc_stats != NULL) {
+        task_alloc_stats = atoi(alloc_stats) != 0;
+    }
+    char const* schedule = getenv("OMP_SCHEDULE");
+    if(schedule != NULL) {
+        parse_schedule(schedule, initial_thread->icv);
+    }
+}
+
+
+// On hpx threads the current task is kept in the hpx thread data. Threads that
+// are not hpx threads only get a task of their own inside serialized regions,
+// otherwise they run the initial task.
+static thread_local omp_task_data *external_task_data = nullptr;
+
+// Makes data the current task of the calling thread, returns the previous one.
+omp_task_data* exchange_current_task(omp_task_data *data)
+{
+    omp_task_data *previous;
+    if(hpx::threads::get_self_ptr()) {
+        previous = reinterpret_cast<omp_task_data*>(get_thread_data(get_self_id()));
+        set_thread_data(get_self_id(), reinterpret_cast<size_t>(data));
+    } else {
+        previous = external_task_data;
+        external_task_data = data;
+    }
+    return previous;
+}
+
+std::uint64_t sharded_task_counter::pending() const
+{
+    std::uint64_t completed = 0;
+    for(std::size_t i = 0; i < num_shards; i++) {
+        completed += shards[i].completed.load();
+    }
+    std::uint64_t created = 0;
+    for(std::size_t i = 0; i < num_shards; i++) {
+        created += shards[i].created.load();
+    }
+    return created - completed;
+}
+
+//drops the tasks of an entry that have finished, true if none are left
+bool depends_map::prune(entry &e)
+{
+    if(e.last_out.valid() && e.last_out.is_ready()) {
+        e.last_out = shared_future<void>();
+        e.out_depth = 0;
+    }
+    e.readers.erase(std::remove_if(e.readers.begin(), e.readers.end(),
+                        [](shared_future<void> const &f) { return f.is_ready(); }),
+                    e.readers.end());
+    if(e.readers.empty()) {
+        e.readers_depth = 0;
+    }
+    return !e.last_out.valid() && e.readers.empty();
+}
+
+std::size_t depends_map::slot(int64_t addr) const
+{
+    std::uint64_t h = static_cast<std::uint64_t>(addr) * 0x9E3779B97F4A7C15ull;
+    return (h ^ (h >> 32)) & (slots.size() - 1);
+}
+
+depends_map::entry* depends_map::find(int64_t addr)
+{
+    if(used == 0)
+        return nullptr;
+    for(std::size_t i = slot(addr); slots[i].used; i = (i + 1) & (slots.size() - 1)) {
+        if(slots[i].addr == addr)
+            return &slots[i];
+    }
+    return nullptr;
+}
+
+depends_map::entry& depends_map::insert(int64_t addr)
+{
+    if(4 * (used + 1) > 3 * slots.size()) {
+        rehash();
+    }
+    std::size_t i = slot(addr);
+    while(slots[i].used) {
+        if(slots[i].addr == addr)
+            return slots[i];
+        i = (i + 1) & (slots.size() - 1);
+    }
+    slots[i].used = true;
+    slots[i].addr = addr;
+    used++;
+    return slots[i];
+}
+
+//leaves out the entries without unfinished tasks, so the table only grows
+// with the number of addresses that are in use
+void depends_map::rehash()
+{
+    vector<entry> old;
+    old.swap(slots);
+    std::size_t live = 0;
+    for(auto &e : old) {
+        if(e.used && !prune(e)) {
+            live++;
+        } else {
+            e.used = false;
+        }
+    }
+    std::size_t capacity = 16;
+    while(capacity < 2 * (live + 1)) {
+        capacity *= 2;
+    }
+    slots.resize(capacity);
+    used = 0;
+    for(auto &e : old) {
+        if(e.used) {
+            std::size_t i = slot(e.addr);
+            while(slots[i].used) {
+                i = (i + 1) & (slots.size() - 1);
+            }
+            slots[i] = std::move(e);
+            used++;
+        }
+    }
+}
+
+void depends_map::predecessors(int64_t addr, bool out, task_predecessors &preds)
+{
+    entry *e = find(addr);
+    if(e == nullptr || prune(*e))
+        return;
+    if(e->last_out.valid()) {
+        preds.add(e->last_out, e->out_depth);
+    }
+    //a writer also waits for the readers of the previous value
+    if(out) {
+        for(auto const &f : e->readers) {
+            preds.add(f, e->readers_depth);
+        }
+    }
+}
+
+void depends_map::record(int64_t addr, bool out, shared_future<void> const &task,
+                         std::uint32_t depth)
+{
+    entry &e = insert(addr);
+    if(out) {
+        e.last_out = task;
+        e.out_depth = depth;
+        e.readers.clear();
+        e.readers_depth = 0;
+    } else {
+        e.readers.push_back(task);
+        e.readers_depth = std::max(e.readers_depth, depth);
+    }
+}
+
+void depends_map::clear()
+{
+    slots.clear();
+    used = 0;
+}
+
+omp_task_ext::omp_task_ext()
+{
+    for(auto &slot : ring) {
+        slot.store(nullptr, std::memory_order_relaxed);
+    }
+}
+
+omp_task_ext::~omp_task_ext()
+{
+    clear_ring();
+}
+
+void omp_task_ext::push_child(kmp_task_t *task)
+{
+    intrusive_ptr_add_ref(task);
+    kmp_task_t *old = ring[ring_head++ % ring_size].exchange(task, std::memory_order_acq_rel);
+    if(old) {
+        intrusive_ptr_release(old);
+    }
+}
+
+void omp_task_ext::clear_ring()
+{
+    for(auto &slot : ring) {
+        kmp_task_t *task = slot.exchange(nullptr, std::memory_order_acquire);
+        if(task) {
+            intrusive_ptr_release(task);
+        }
+    }
+}
+
+//how often a waiting thread yields before it suspends until the last task
+// it waits for wakes it up
+static const int wait_spin_yields = 64;
+
+//yields a few times, then suspends on cond until done() holds. The thread that
+// makes done() true notifies cond under mtx once it sees waiters non-zero.
+template <typename Done>
+static void spin_then_wait( Done done, atomic<int> &waiters, mutex_type &mtx,
+                            hpx::lcos::local::condition_variable_any &cond )
+{
+    for(int i = 0; i < wait_spin_yields; i++) {
+        if(done()) {
+            return;
+        }
+        hpx::this_thread::yield();
+    }
+    std::unique_lock<mutex_type> l(mtx);
+    waiters.fetch_add(1);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    while(!done()) {
+        cond.wait(l);
+    }
+    waiters.fetch_sub(1);
+}
+
+void omp_task_ext::wait_children()
+{
+    spin_then_wait([this]() { return (pending_children.load() & 0xffffffff) == 0; },
+                   waiters, wait_mtx, wait_cond);
+}
+
+void omp_task_ext::wait_taskgroup()
+{
+    spin_then_wait([this]() { return (pending_children.load() >> 32) == 0; },
+                   waiters, wait_mtx, wait_cond);
+}
+
+void sharded_task_counter::wait()
+{
+    spin_then_wait([this]() { return pending() == 0; }, waiters, wait_mtx, wait_cond);
+}
+
+void task_throttle::init(std::size_t workers, std::int64_t max_pending)
+{
+    this->workers = make_aligned_array<worker_data>(workers);
+    num_workers = workers;
+    limit = max_pending;
+}
+
+bool task_throttle::defer_task(kmp_task_header_t *header)
+{
+    std::size_t worker = hpx::get_worker_thread_num();
+    if(limit == 0 || worker >= num_workers) {
+        return true;
+    }
+    worker_data &w = workers[worker];
+    if(++w.spawned % global_check_interval == 0) {
+        std::int64_t total = 0;
+        for(std::size_t i = 0; i < num_workers; i++) {
+            total += workers[i].pending.load(std::memory_order_relaxed);
+        }
+        w.global_pending = total;
+    }
+    std::int64_t local_limit = limit;
+    std::int64_t avg = w.avg_duration.load(std::memory_order_relaxed);
+    if(avg > 0) {
+        local_limit = std::max(std::min(backlog_ns / avg, limit), min_limit);
+    }
+    if(w.pending.load(std::memory_order_relaxed) >= local_limit ||
+       w.global_pending >= limit * static_cast<std::int64_t>(num_workers)) {
+        return false;
+    }
+    w.pending.fetch_add(1, std::memory_order_relaxed);
+    header->spawner = static_cast<std::uint32_t>(worker);
+    return true;
+}
+
+void task_throttle::completed(std::uint32_t spawner, std::int64_t duration_ns)
+{
+    workers[spawner].pending.fetch_sub(1, std::memory_order_relaxed);
+    std::size_t worker = hpx::get_worker_thread_num();
+    if(worker < num_workers) {
+        auto &avg = workers[worker].avg_duration;
+        std::int64_t old_avg = avg.load(std::memory_order_relaxed);
+        avg.store(old_avg + (duration_ns - old_avg) / 8, std::memory_order_relaxed);
+    }
+}
+
+parallel_region::~parallel_region() = default;
+
+void parallel_region::reset( parallel_region *parent )
+{
+    depth = parent->depth + 1;
+    single_counter = 0;
+    current_single_thread = -1;
+    copyprivate_data = nullptr;
+    //every thread left its last loop, loop_num starts over with the
+    // implicit task data
+    for(int i = 0; i < loop_ring_size; i++) {
+        loop_ring[i].seq = 2 * i;
+        loop_ring[i].finished = 0;
+    }
+#if (HPXMP_HAVE_OMPT)
+    parent_data = parent->parent_data;
+    parallel_data = ompt_data_none;
+#endif
+}
+
+// The region keeps a reference to the implicit task data of every thread, so
+// the data outlives the region and is reused by the next fork.
+omp_task_data* parallel_region::implicit_task_data( int tid, omp_task_data *parent )
+{
+    auto &slot = implicit_tasks[tid];
+    if(!slot) {
+        slot.reset(new omp_task_data(tid, this, parent));
+        //created up front, barriers look at it from other threads
+        slot->get_ext();
+    } else {
+        //tasks of the previous region may not have dropped their reference yet
+        while(slot->pointer_counter > 1) {
+            hpx::this_thread::yield();
+        }
+        slot->reset_implicit(tid, this, parent);
+    }
+    return slot.get();
+}
+
+// Returns a cached region of the requested size for the depth below parent.
+// Without one, an idle slot of that depth gets a new region, preferably an
+// empty slot over one that holds a region of another size. If all slots are
+// in use, or the depth is not cached, a new region is allocated which
+// release_region deletes again.
+parallel_region* hpx_runtime::acquire_region(parallel_region *parent, int num_threads)
+{
+    int depth = parent->depth + 1;
+    if(depth >= max_cached_depth) {
+        return new parallel_region(parent, num_threads);
+    }
+    int spare = -1;
+    for(int i = 0; i < regions_per_depth; i++) {
+        auto &slot = region_cache[depth][i];
+        if(slot.busy.load(std::memory_order_relaxed) ||
+           slot.busy.exchange(true, std::memory_order_acquire)) {
+            continue;
+        }
+        if(slot.region && slot.region->num_threads == num_threads) {
+            if(spare >= 0) {
+                region_cache[depth][spare].busy.store(false, std::memory_order_release);
+            }
+            slot.region->reset(parent);
+            return slot.region.get();
+        }
+        if(spare < 0 || (region_cache[depth][spare].region && !slot.region)) {
+            if(spare >= 0) {
+                region_cache[depth][spare].busy.store(false, std::memory_order_release);
+            }
+            spare = i;
+        } else {
+            slot.busy.store(false, std::memory_order_release);
+        }
+    }
+    if(spare < 0) {
+        return new parallel_region(parent, num_threads);
+    }
+    auto &slot = region_cache[depth][spare];
+    slot.region.reset(new parallel_region(parent, num_threads));
+    slot.region->cache_index = spare;
+    return slot.region.get();
+}
+
+void hpx_runtime::release_region(parallel_region *region)
+{
+    if(region->cache_index >= 0) {
+        region_cache[region->depth][region->cache_index].busy.store(false, std::memory_order_release);
+    } else {
+        delete region;
+    }
+}
+
+hpx_runtime::serialized_teams& hpx_runtime::local_serialized_teams()
+{
+    std::size_t worker = hpx::get_worker_thread_num();
+    return serialized_cache[std::min(worker, num_serialized_caches - 1)];
+}
+
+// A serialized region is a team of one that runs on the encountering thread,
+// which can also be a thread that is not an hpx thread. The team comes from
+// the list of the worker it starts on and goes back to the list of the
+// worker it ends on.
+void hpx_runtime::serialized_parallel_begin()
+{
+    auto parent = get_task_data();
+    parallel_region *team = nullptr;
+    {
+        auto &cache = local_serialized_teams();
+        std::lock_guard<mutex_type> l(cache.mtx);
+        if(!cache.teams.empty()) {
+            team = cache.teams.back().release();
+            cache.teams.pop_back();
+        }
+    }
+    if(team) {
+        team->reset(parent->team);
+    } else {
+        team = new parallel_region(parent->team, 1);
+    }
+    team->encountering_task = exchange_current_task(
+            team->implicit_task_data(0, parent.get()));
+}
+
+void hpx_runtime::serialized_parallel_end()
+{
+    parallel_region *team = get_team();
+    omp_task_data *encountering = team->encountering_task;
+    exchange_current_task(encountering);
+    {
+        auto &cache = local_serialized_teams();
+        std::lock_guard<mutex_type> l(cache.mtx);
+        if(cache.teams.size() < max_serialized_teams) {
+            cache.teams.emplace_back(team);
+            team = nullptr;
+        }
+    }
+    delete team;
+    auto parent = get_task_data();
+    parent->set_threads_requested(parent->icv.nthreads);
 }
 
 parallel_region* hpx_runtime::get_team()
 {
-    auto task_data = get_task_data();
-    auto team = task_data->team;
-    return team;
+    return current_task()->team;
 }
 
 bool hpx_runtime::set_thread_data_check() {
@@ -164,21 +714,29 @@ bool hpx_runtime::set_thread_data_check() {
     return false;
 }
 
-intrusive_ptr<omp_task_data> hpx_runtime::get_task_data()
+// Borrowed pointer to the task data of the calling thread, no reference is
+// taken. The hpx thread data is the per thread cache of the current task, an
+// os thread_local cache would go stale once the hpx thread is resumed on
+// another worker. Use get_task_data to keep the data past the current task.
+omp_task_data* hpx_runtime::current_task()
 {
-    omp_task_data *data;
     if(hpx::threads::get_self_ptr()) {
-        data = reinterpret_cast<omp_task_data*>(get_thread_data(get_self_id()));
-        if(!data) {
-            std::cerr<<"trying to get null hpx thread data\n";
-            data = initial_thread.get();
+        omp_task_data *data = reinterpret_cast<omp_task_data*>(get_thread_data(get_self_id()));
+        if(HPX_LIKELY(data != nullptr)) {
+            return data;
         }
+        std::cerr<<"trying to get null hpx thread data\n";
+        return initial_thread.get();
     }
-    else {
-        data = initial_thread.get();
+    if(external_task_data) {
+        return external_task_data;
     }
-    intrusive_ptr<omp_task_data> data_ptr(data);
-    return data_ptr;
+    return initial_thread.get();
+}
+
+intrusive_ptr<omp_task_data> hpx_runtime::get_task_data()
+{
+    return intrusive_ptr<omp_task_data>(current_task());
 }
 
 double hpx_runtime::get_time() {
@@ -195,18 +753,23 @@ int hpx_runtime::get_num_procs() {
 
 void hpx_runtime::set_num_threads(int nthreads) {
     if(nthreads > 0) {
-        get_task_data()->icv.nthreads = nthreads;
-        get_task_data()->threads_requested = nthreads;
+        omp_task_data *task = current_task();
+        task->icv.nthreads = nthreads;
+        task->threads_requested = nthreads;
     }
 }
 
 int hpx_runtime::get_thread_num() {
-    return get_task_data()->local_thread_num;
+    return current_task()->local_thread_num;
 }
 
 // this should only be called from implicit tasks
 void hpx_runtime::barrier_wait(){
     auto *team = get_team();
+    //a team of one runs its tasks inline, nothing can be outstanding
+    if(team->num_threads == 1) {
+        return;
+    }
     task_wait();
 #ifdef OMP_COMPLIANT
     while(team->exec->num_pending_closures() > 0 ) {
@@ -217,59 +780,109 @@ void hpx_runtime::barrier_wait(){
     if(team->num_threads > 1) {
         team->globalBarrier.wait();
     }
-    //wait for all child tasks to be done
-    team->teamTaskLatch.wait();
+    //wait for all child tasks to be done, running the ones still queued
+    wait_team_tasks(get_thread_num(), team);
 }
 
 //TODO: Does the spec say that outstanding tasks need to end before this begins?
 bool hpx_runtime::start_taskgroup()
 {
-    auto task = get_task_data();
+    omp_task_data *task = current_task();
 #if HPXMP_HAVE_OMP_50_ENABLED
     intrusive_ptr<kmp_taskgroup_t> tg_new(new kmp_taskgroup_t());
     tg_new->reduce_num_data = 0;
-    task->td_taskgroup = tg_new;
+    tg_new->parent = task->get_ext().td_taskgroup;
+    task->get_ext().td_taskgroup = tg_new;
 #endif
     task->in_taskgroup = true;
 #ifdef OMP_COMPLIANT
     //FIXME: why is this local_thread_num? shouldn't it be team->num_threads
     //task->tg_exec.reset(new local_priority_queue_executor(task->local_thread_num));
-    task->tg_exec.reset(new local_priority_queue_executor(task->team->num_threads));
-#else
-    task->taskgroupLatch.reset(new hpxmp_latch(1));
+    task->get_ext().tg_exec.reset(new local_priority_queue_executor(task->team->num_threads));
 #endif
     return true;
 }
 
 void hpx_runtime::end_taskgroup()
 {
-    auto task = get_task_data();
+    omp_task_data *task = current_task();
 #ifdef OMP_COMPLIANT
-    task->tg_exec.reset();
+    task->get_ext().tg_exec.reset();
 #else
-    task->taskgroupLatch->count_down_and_wait();
+    if(task->ext) {
+        taskgraph_not_replayable(task);
+        run_pending_children(task->local_thread_num, task, true);
+        task->ext->wait_taskgroup();
+    }
 #endif
     task->in_taskgroup = false;
 
 #if HPXMP_HAVE_OMP_50_ENABLED
-    auto taskgroup = task->td_taskgroup;
-    if (taskgroup->reduce_data != NULL) // need to reduce?
+    auto taskgroup = task->get_ext().td_taskgroup;
+    release_reduction_copies(task, taskgroup.get());
+    if (!taskgroup->reduce_data.empty()) // need to reduce?
         __kmp_task_reduction_fini(nullptr,taskgroup);
+    //back to the enclosing taskgroup, if any
+    task->ext->td_taskgroup = taskgroup->parent;
+    task->in_taskgroup = taskgroup->parent != nullptr;
 #endif
 }
 
 void hpx_runtime::task_wait()
 {
-    auto task = get_task_data();
-    intrusive_ptr<omp_task_data> task_ptr(task);
-    task_ptr->taskLatch.wait();
+    //a task without an extension never created a child
+    omp_task_data *task = current_task();
+    if(task->ext) {
+        taskgraph_not_replayable(task);
+        //help first, then wait for the children other workers picked up
+        run_pending_children(task->local_thread_num, task, true);
+        task->ext->wait_children();
+    }
 }
 
-void task_setup( int gtid, intrusive_ptr<kmp_task_t> kmp_task_ptr, intrusive_ptr<omp_task_data> parent_task_ptr)
+// Waits for the sibling tasks the listed dependences would make a new task
+// wait for, used by undeferred tasks and taskwait with depend clauses.
+void hpx_runtime::wait_deps( int gtid, int ndeps, kmp_depend_info_t *dep_list,
+                             int ndeps_noalias, kmp_depend_info_t *noalias_dep_list )
+{
+    //a task without an extension never recorded a dependence
+    omp_task_data *task = current_task();
+    if(!task->ext) {
+        return;
+    }
+    taskgraph_not_replayable(task);
+    task_predecessors preds;
+    for(int i = 0; i < ndeps; i++) {
+        task->ext->df_map.predecessors(dep_list[i].base_addr, dep_list[i].flags.out, preds);
+    }
+    for(int i = 0; i < ndeps_noalias; i++) {
+        task->ext->df_map.predecessors(noalias_dep_list[i].base_addr, noalias_dep_list[i].flags.out, preds);
+    }
+    //run queued children while there are any, then suspend
+    auto wait = [&](shared_future<void> const &f) {
+        while(!f.is_ready()) {
+            if(!run_pending_children(task->local_thread_num, task, true)) {
+                f.wait();
+            }
+        }
+    };
+    for(std::size_t i = 0; i < std::min<std::size_t>(preds.count, 2); i++) {
+        wait(preds.first[i]);
+    }
+    for(auto const &f : preds.rest) {
+        wait(f);
+    }
+}
+
+// Runs an explicit task on the calling thread and accounts for its
+// completion. Called by the hpx thread of the task, or by a thread that runs
+// it while waiting in taskwait or a barrier.
+void run_task( int gtid, kmp_task_t *kmp_task, omp_task_data *parent_task )
 {
-    auto task_func = kmp_task_ptr->routine;
-    intrusive_ptr<omp_task_data> current_task_ptr(new omp_task_data(gtid, parent_task_ptr->team, parent_task_ptr->icv));
-    set_thread_data( get_self_id(), reinterpret_cast<size_t>(current_task_ptr.get()));
+    auto task_func = kmp_task->routine;
+    intrusive_ptr<omp_task_data> current_task_ptr(new omp_task_data(gtid, parent_task->team, parent_task->icv));
+    current_task_ptr->final_task = parent_task->final_task || task_header(kmp_task)->final;
+    omp_task_data *encountering = exchange_current_task(current_task_ptr.get());
 #if HPXMP_HAVE_OMPT
     ompt_data_t *my_task_data = &hpx_backend->get_task_data()->task_data;
     if (ompt_enabled.ompt_callback_task_create)
@@ -287,14 +900,22 @@ void task_setup( int gtid, intrusive_ptr<kmp_task_t> kmp_task_ptr, intrusive_ptr
             prior_task_data, status, my_task_data);
     }
 #endif
+    std::uint32_t spawner = task_header(kmp_task)->spawner;
+    std::int64_t started = spawner != task_throttle::untracked ? task_throttle::now() : 0;
     // actually running the taskfunctions
-if(! kmp_task_ptr->gcc)
-    task_func(gtid, kmp_task_ptr.get());
+if(! task_header(kmp_task)->gcc)
+    task_func(gtid, kmp_task);
 else
-    ((void (*)(void *))(*(kmp_task_ptr->routine)))(kmp_task_ptr->shareds);
+    ((void (*)(void *))(*(kmp_task->routine)))(kmp_task->shareds);
+#if HPXMP_HAVE_OMP_50_ENABLED
+    release_reduction_copies(current_task_ptr.get());
+#endif
+    if(spawner != task_throttle::untracked) {
+        hpx_backend->throttle.completed(spawner, task_throttle::now() - started);
+    }
 #ifndef OMP_COMPLIANT
     //count down number of tasks under team
-    current_task_ptr->team->teamTaskLatch.count_down(1);
+    current_task_ptr->team->teamTasks.completed();
 #endif
 
 #if HPXMP_HAVE_OMPT
@@ -306,11 +927,69 @@ else
             my_task_data, status_fin, prior_task_data);
     }
 #endif
-    //if task is in taskgroup, count down taskgroup latch as this task is done
-    if(parent_task_ptr->in_taskgroup)
-        parent_task_ptr->taskgroupLatch->count_down(1);
-    //tell parent I am done
-    parent_task_ptr->taskLatch.count_down(1);
+    exchange_current_task(encountering);
+    //tell parent I am done, and the taskgroup I was created in
+    parent_task->ext->child_completed(task_header(kmp_task)->in_taskgroup);
+}
+
+void task_setup( int gtid, intrusive_ptr<kmp_task_t> kmp_task_ptr, intrusive_ptr<omp_task_data> parent_task_ptr)
+{
+    //a waiting thread may have run it already
+    if(task_header(kmp_task_ptr.get())->claimed.exchange(true, std::memory_order_acq_rel)) {
+        return;
+    }
+    run_task(gtid, kmp_task_ptr.get(), parent_task_ptr.get());
+}
+
+// Runs the deferred children of parent that no hpx thread has started yet,
+// newest first when called by parent itself. Returns whether any was run.
+bool run_pending_children( int gtid, omp_task_data *parent, bool owner )
+{
+    omp_task_ext *ext = parent->ext.get();
+    if(!ext) {
+        return false;
+    }
+    bool ran = false;
+    unsigned newest = owner ? ext->ring_head - 1 : omp_task_ext::ring_size - 1;
+    for(unsigned i = 0; i < omp_task_ext::ring_size; i++) {
+        auto &slot = ext->ring[(newest - i) % omp_task_ext::ring_size];
+        kmp_task_t *task = slot.exchange(nullptr, std::memory_order_acquire);
+        if(!task) {
+            continue;
+        }
+        if(!task_header(task)->claimed.exchange(true, std::memory_order_acq_rel)) {
+            run_task(gtid, task, parent);
+            ran = true;
+        }
+        intrusive_ptr_release(task);
+    }
+    return ran;
+}
+
+// Helps with the deferred children of every implicit task of the team. Only
+// called once all of them reached the barrier or finished, their extensions
+// are created with them and stay put until the region is reused.
+bool run_pending_team_tasks( int gtid, parallel_region *team )
+{
+    bool ran = false;
+    for(auto &implicit : team->implicit_tasks) {
+        if(implicit) {
+            ran |= run_pending_children(gtid, implicit.get(), false);
+        }
+    }
+    return ran;
+}
+
+//helps with the queued tasks of the team while there are any, then suspends
+// until the last one finishes
+void wait_team_tasks( int gtid, parallel_region *team )
+{
+    while(team->teamTasks.pending() != 0) {
+        if(!run_pending_team_tasks(gtid, team)) {
+            team->teamTasks.wait();
+            return;
+        }
+    }
 }
 
 #ifdef OMP_COMPLIANT
@@ -326,16 +1005,53 @@ void tg_task_setup( int gtid, kmp_task_t *task, omp_icv icv,
 
     task_func(gtid, task);
 
-    delete[] (char*)task;
+    free_task(task);
 }
 #endif
 
+// Tasks of a team of one, tasks held back by the throttle and tasks created
+// inside a final task are undeferred, they run to completion on the
+// encountering thread with a task data of their own.
+void execute_task_inline( int gtid, kmp_task_t *kmp_task, omp_task_data *parent )
+{
+    intrusive_ptr<omp_task_data> task_data(new omp_task_data(gtid, parent->team, parent->icv));
+    task_data->final_task = parent->final_task || task_header(kmp_task)->final;
+    omp_task_data *encountering = exchange_current_task(task_data.get());
+    if(! task_header(kmp_task)->gcc)
+        kmp_task->routine(gtid, kmp_task);
+    else
+        ((void (*)(void *))(*(kmp_task->routine)))(kmp_task->shareds);
+#if HPXMP_HAVE_OMP_50_ENABLED
+    release_reduction_copies(task_data.get());
+#endif
+    exchange_current_task(encountering);
+}
+
+// Tasks with a priority above zero go to the high priority queues of hpx. The
+// value is capped by OMP_MAX_TASK_PRIORITY, its default of 0 turns priorities
+// off.
+static hpx::threads::thread_priority task_priority( kmp_task_t *task, omp_task_data *parent )
+{
+    if(task_header(task)->has_priority &&
+       std::min(task->data2.priority, parent->icv.device->max_task_priority) > 0) {
+        return hpx::threads::thread_priority_high;
+    }
+    return hpx::threads::thread_priority_normal;
+}
+
 //shared_ptr is used for these counters, because the parent/calling task may terminate at any time,
 //causing its omp_task_data to be deallocated.
 void hpx_runtime::create_task( kmp_routine_entry_t task_func, int gtid, intrusive_ptr<kmp_task_t> kmp_task_ptr)
 {
     auto current_task_ptr = get_task_data();
-    if(current_task_ptr->team->num_threads > 0) {
+    if(current_task_ptr->ext && current_task_ptr->ext->recording) {
+        current_task_ptr->ext->recording->record(kmp_task_ptr.get(), 0, nullptr, 0, nullptr);
+    }
+    //a team of one, a final parent, or too many deferred tasks already
+    if(current_task_ptr->team->num_threads == 1 || current_task_ptr->final_task ||
+       !throttle.defer_task(task_header(kmp_task_ptr.get()))) {
+        execute_task_inline(gtid, kmp_task_ptr.get(), current_task_ptr.get());
+    } else {
 #ifdef OMP_COMPLIANT
         if(current_task->in_taskgroup) {
             hpx::apply( *(current_task->tg_exec), tg_task_setup, gtid, thunk, current_task->icv,
@@ -348,18 +1064,21 @@ void hpx_runtime::create_task( kmp_routine_entry_t task_func, int gtid, intrusiv
 #else
         //this is waited in taskwait, wait for all tasks before taskwait created to be done
         // create_task function is not supposed to wait anything
-        current_task_ptr->taskLatch.count_up(1);
+        //counted once for taskwait and, if we are under a taskgroup
+        // construct, for the taskgroup
+        task_header(kmp_task_ptr.get())->in_taskgroup = current_task_ptr->in_taskgroup;
+        omp_task_ext &ext = current_task_ptr->get_ext();
+        ext.child_created(current_task_ptr->in_taskgroup);
         //count up number of tasks in this team
-        current_task_ptr->team->teamTaskLatch.count_up(1);
-        //count up number of task in taskgroup if we are under taskgroup construct
-        if(current_task_ptr->in_taskgroup)
-            current_task_ptr->taskgroupLatch->count_up(1);
+        current_task_ptr->team->teamTasks.created();
+        //lets taskwait and barriers run it if no worker got to it yet
+        ext.push_child(kmp_task_ptr.get());
         //this fixes hpx::apply changes in hpx backend
         //TPool.enqueue(&task_setup, gtid, kmp_task_ptr, current_task_ptr);
         hpx::applier::register_thread_nullary(
             std::bind(&task_setup, gtid, kmp_task_ptr, current_task_ptr),
             "omp_explicit_task", hpx::threads::pending, true,
-            hpx::threads::thread_priority_normal);
+            task_priority(kmp_task_ptr.get(), current_task_ptr.get()));
 #endif
     }
 //    else {
@@ -368,8 +1087,518 @@ void hpx_runtime::create_task( kmp_routine_entry_t task_func, int gtid, intrusiv
 //    }
 }
 
-//deps will notify when_all function
-void df_task_wrapper( int gtid, kmp_task_t *task, intrusive_ptr<omp_task_data> parent_task_ptr, vector<shared_future<void>> deps)
+// A new task with the same private data as task, the shareds are copied
+// along with it.
+kmp_task_t* duplicate_task( kmp_task_t *task )
+{
+    kmp_task_header_t *header = task_header(task);
+    kmp_task_t *copy = allocate_task(header->size);
+    memcpy(copy, task, header->size);
+    if(task->shareds) {
+        copy->shareds = (char*)copy + ((char*)task->shareds - (char*)task);
+    }
+    kmp_task_header_t *copy_header = task_header(copy);
+    copy_header->gcc = header->gcc;
+    copy_header->final = header->final;
+    copy_header->untied = header->untied;
+    copy_header->has_priority = header->has_priority;
+    return copy;
+}
+
+typedef void (*taskloop_dup_t)( kmp_task_t *dst, kmp_task_t *src, int lastpriv );
+
+// Shared by all tasks of one taskloop. The pattern is the task the compiler
+// allocated, every chunk is a copy of it with bounds of its own.
+struct taskloop_data {
+    ~taskloop_data() { free_task(pattern); }
+
+    kmp_task_t *pattern;
+    std::uint64_t lower;
+    std::int64_t st;
+    std::uint64_t num_tasks;
+    std::uint64_t grainsize;
+    //the first extras chunks get one iteration more
+    std::uint64_t extras;
+    std::size_t lower_offset;
+    std::size_t upper_offset;
+    taskloop_dup_t task_dup;
+    //chunks up to this many are spawned directly, larger ranges are split
+    std::uint64_t leaf_size;
+    atomic<int> pointer_counter{0};
+};
+
+inline void intrusive_ptr_add_ref(taskloop_data *x)
+{
+    ++x->pointer_counter;
+}
+
+inline void intrusive_ptr_release(taskloop_data *x)
+{
+    if (--x->pointer_counter == 0)
+        delete x;
+}
+
+// private data of the tasks that split a range of chunks
+struct taskloop_range {
+    taskloop_data *loop;
+    std::uint64_t first;
+    std::uint64_t last;
+};
+
+kmp_task_t* make_taskloop_chunk( taskloop_data *loop, std::uint64_t c )
+{
+    std::uint64_t first_iter = c * loop->grainsize + std::min(c, loop->extras);
+    std::uint64_t count = loop->grainsize + (c < loop->extras ? 1 : 0);
+    std::uint64_t lower = loop->lower + first_iter * loop->st;
+    kmp_task_t *chunk = duplicate_task(loop->pattern);
+    *(std::uint64_t*)((char*)chunk + loop->lower_offset) = lower;
+    *(std::uint64_t*)((char*)chunk + loop->upper_offset) = lower + (count - 1) * loop->st;
+    if(loop->task_dup) {
+        loop->task_dup(chunk, loop->pattern, c == loop->num_tasks - 1);
+    }
+    return chunk;
+}
+
+int taskloop_split_task( int gtid, void *task );
+
+// Hands the upper half of the range to a new task until it is small enough,
+// so that creating the chunks is spread over the workers as a binary tree.
+void spawn_taskloop_range( int gtid, taskloop_data *loop,
+                           std::uint64_t first, std::uint64_t last )
+{
+    while(last - first > loop->leaf_size) {
+        std::uint64_t mid = first + (last - first) / 2;
+        kmp_task_t *split = allocate_task(sizeof(kmp_task_t) + sizeof(taskloop_range));
+        split->shareds = nullptr;
+        split->routine = taskloop_split_task;
+        split->part_id = 0;
+        taskloop_range *range = reinterpret_cast<taskloop_range*>(split + 1);
+        intrusive_ptr_add_ref(loop);
+        range->loop = loop;
+        range->first = mid;
+        range->last = last;
+        hpx_backend->create_task(split->routine, gtid, split);
+        last = mid;
+    }
+    for(std::uint64_t c = first; c < last; c++) {
+        kmp_task_t *chunk = make_taskloop_chunk(loop, c);
+        hpx_backend->create_task(chunk->routine, gtid, chunk);
+    }
+}
+
+int taskloop_split_task( int gtid, void *task )
+{
+    taskloop_range *range = reinterpret_cast<taskloop_range*>(static_cast<kmp_task_t*>(task) + 1);
+    spawn_taskloop_range(gtid, range->loop, range->first, range->last);
+    //a taskgroup or taskwait around the taskloop only sees this task, so it
+    // is done once its chunks are
+    hpx_backend->task_wait();
+    intrusive_ptr_release(range->loop);
+    return 0;
+}
+
+// lb and ub point into task, st is the loop increment. sched is 0 without a
+// clause, 1 for grainsize and 2 for num_tasks, the chunking follows libomp.
+void hpx_runtime::taskloop( int gtid, kmp_task_t *task, int if_val,
+                            std::uint64_t *lb, std::uint64_t *ub, std::int64_t st,
+                            int nogroup, int sched, std::uint64_t grainsize, void *task_dup )
+{
+    std::uint64_t lower = *lb;
+    std::uint64_t upper = *ub;
+    std::uint64_t tc;
+    if(st == 1) {
+        tc = upper - lower + 1;
+    } else if(st < 0) {
+        tc = (lower - upper) / (-st) + 1;
+    } else {
+        tc = (upper - lower) / st + 1;
+    }
+    int nth = current_task()->team->num_threads;
+
+    std::uint64_t num_tasks, extras;
+    switch(sched) {
+        case 0:
+            //no clause, aim for 10 tasks per thread
+            grainsize = nth * 10;
+            HPX_FALLTHROUGH;
+        case 2:
+            //grainsize holds num_tasks here
+            grainsize = std::max<std::uint64_t>(grainsize, 1);
+            if(grainsize > tc) {
+                num_tasks = tc;
+                grainsize = 1;
+                extras = 0;
+            } else {
+                num_tasks = grainsize;
+                grainsize = tc / num_tasks;
+                extras = tc % num_tasks;
+            }
+            break;
+        default:
+            grainsize = std::max<std::uint64_t>(grainsize, 1);
+            if(grainsize > tc) {
+                num_tasks = 1;
+                grainsize = tc;
+                extras = 0;
+            } else {
+                num_tasks = tc / grainsize;
+                grainsize = tc / num_tasks;
+                extras = tc % num_tasks;
+            }
+            break;
+    }
+
+    //the chunks and split tasks only live as long as this taskloop
+    taskgraph_not_replayable(current_task());
+
+    intrusive_ptr<taskloop_data> loop(new taskloop_data);
+    loop->pattern = task;
+    loop->lower = lower;
+    loop->st = st;
+    loop->num_tasks = num_tasks;
+    loop->grainsize = grainsize;
+    loop->extras = extras;
+    loop->lower_offset = (char*)lb - (char*)task;
+    loop->upper_offset = (char*)ub - (char*)task;
+    loop->task_dup = reinterpret_cast<taskloop_dup_t>(task_dup);
+    loop->leaf_size = std::max(nth, 2);
+
+    if(!nogroup) {
+        start_taskgroup();
+    }
+    if(!if_val) {
+        //undeferred, the chunks run one after the other
+        omp_task_data *current = current_task();
+        for(std::uint64_t c = 0; c < num_tasks; c++) {
+            kmp_task_t *chunk = make_taskloop_chunk(loop.get(), c);
+            execute_task_inline(gtid, chunk, current);
+            free_task(chunk);
+        }
+    } else {
+        spawn_taskloop_range(gtid, loop.get(), 0, num_tasks);
+    }
+    if(!nogroup) {
+        end_taskgroup();
+    }
+}
+
+task_graph::~task_graph()
+{
+    for(kmp_task_t *task : tasks) {
+        free_task(task);
+    }
+}
+
+void task_graph::record(kmp_task_t *task, int ndeps, kmp_depend_info_t *dep_list,
+                        int ndeps_noalias, kmp_depend_info_t *noalias_dep_list)
+{
+    std::uint32_t node = static_cast<std::uint32_t>(tasks.size());
+    tasks.push_back(duplicate_task(task));
+
+    //same rules as depends_map, on node numbers
+    vector<std::uint32_t> preds;
+    auto find_preds = [&](kmp_depend_info_t const &dep) {
+        auto it = accesses.find(dep.base_addr);
+        if(it == accesses.end())
+            return;
+        if(it->second.last_out >= 0) {
+            preds.push_back(static_cast<std::uint32_t>(it->second.last_out));
+        }
+        if(dep.flags.out) {
+            preds.insert(preds.end(), it->second.readers.begin(), it->second.readers.end());
+        }
+    };
+    auto update = [&](kmp_depend_info_t const &dep) {
+        access &a = accesses[dep.base_addr];
+        if(dep.flags.out) {
+            a.last_out = node;
+            a.readers.clear();
+        } else {
+            a.readers.push_back(node);
+        }
+    };
+    for(int i = 0; i < ndeps; i++) {
+        find_preds(dep_list[i]);
+    }
+    for(int i = 0; i < ndeps_noalias; i++) {
+        find_preds(noalias_dep_list[i]);
+    }
+    std::sort(preds.begin(), preds.end());
+    preds.erase(std::unique(preds.begin(), preds.end()), preds.end());
+    for(std::uint32_t pred : preds) {
+        edges.emplace_back(pred, node);
+    }
+    for(int i = 0; i < ndeps; i++) {
+        update(dep_list[i]);
+        deps.emplace_back(dep_list[i].base_addr, dep_list[i].flags.out != 0);
+    }
+    for(int i = 0; i < ndeps_noalias; i++) {
+        update(noalias_dep_list[i]);
+        deps.emplace_back(noalias_dep_list[i].base_addr, noalias_dep_list[i].flags.out != 0);
+    }
+    dep_begin.push_back(static_cast<std::uint32_t>(deps.size()));
+}
+
+void task_graph::finish()
+{
+    if(state.load(std::memory_order_relaxed) != recording) {
+        //runs like any other region from now on
+        for(kmp_task_t *task : tasks) {
+            free_task(task);
+        }
+        tasks.clear();
+        edges.clear();
+        accesses.clear();
+        deps.clear();
+        return;
+    }
+    std::size_t n = tasks.size();
+    final_index.assign(n, -1);
+    auto add_final = [&](std::uint32_t node) {
+        if(final_index[node] < 0) {
+            final_index[node] = static_cast<std::int32_t>(num_final++);
+        }
+    };
+    for(auto const &a : accesses) {
+        final_access f;
+        f.addr = a.first;
+        f.last_out = a.second.last_out;
+        f.readers_begin = static_cast<std::uint32_t>(final_readers.size());
+        if(f.last_out >= 0) {
+            add_final(static_cast<std::uint32_t>(f.last_out));
+        }
+        for(std::uint32_t reader : a.second.readers) {
+            final_readers.push_back(reader);
+            add_final(reader);
+        }
+        f.readers_end = static_cast<std::uint32_t>(final_readers.size());
+        final_accesses.push_back(f);
+    }
+    accesses.clear();
+    num_predecessors.assign(n, 0);
+    successor_begin.assign(n + 1, 0);
+    for(auto const &edge : edges) {
+        successor_begin[edge.first + 1]++;
+        num_predecessors[edge.second]++;
+    }
+    for(std::size_t i = 0; i < n; i++) {
+        successor_begin[i + 1] += successor_begin[i];
+    }
+    successors.resize(edges.size());
+    vector<std::uint32_t> next(successor_begin.begin(), successor_begin.end() - 1);
+    for(auto const &edge : edges) {
+        successors[next[edge.first]++] = edge.second;
+    }
+    for(std::uint32_t i = 0; i < n; i++) {
+        if(num_predecessors[i] == 0) {
+            roots.push_back(i);
+        }
+    }
+    vector<std::pair<std::uint32_t, std::uint32_t>>().swap(edges);
+    state.store(ready, std::memory_order_release);
+}
+
+void taskgraph_not_replayable(omp_task_data *task)
+{
+    if(task->ext && task->ext->recording) {
+        task->ext->recording->state.store(task_graph::not_replayable, std::memory_order_relaxed);
+    }
+}
+
+// One replay of a task graph. All its tasks are counted as children of the
+// encountering task up front, the last one to finish frees it.
+struct task_graph_replay {
+    task_graph const *graph;
+    intrusive_ptr<omp_task_data> parent;
+    int gtid;
+    bool in_taskgroup;
+    //graph predecessors not done yet, plus one while siblings created
+    // before the region hold the node back
+    std::unique_ptr<atomic<std::uint32_t>[]> pending;
+    atomic<std::uint32_t> remaining;
+    //set once the nodes in final_accesses are done, only for nowait replays
+    std::unique_ptr<hpx::lcos::local::promise<void>[]> finished;
+};
+
+void spawn_replayed_task( task_graph_replay *replay, std::uint32_t node );
+
+void release_replayed_task( task_graph_replay *replay, std::uint32_t node )
+{
+    if(replay->pending[node].fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        spawn_replayed_task(replay, node);
+    }
+}
+
+//runs once the siblings created before the region that node depends on are done
+void replayed_task_ready( task_graph_replay *replay, std::uint32_t node,
+                          vector<shared_future<void>> const &)
+{
+    release_replayed_task(replay, node);
+}
+
+void run_replayed_task( task_graph_replay *replay, std::uint32_t node, kmp_task_t *task )
+{
+    run_task(replay->gtid, task, replay->parent.get());
+    free_task(task);
+    task_graph const *graph = replay->graph;
+    if(replay->finished && graph->final_index[node] >= 0) {
+        replay->finished[graph->final_index[node]].set_value();
+    }
+    for(std::uint32_t i = graph->successor_begin[node]; i < graph->successor_begin[node + 1]; i++) {
+        release_replayed_task(replay, graph->successors[i]);
+    }
+    if(replay->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        delete replay;
+    }
+}
+
+void spawn_replayed_task( task_graph_replay *replay, std::uint32_t node )
+{
+    kmp_task_t *task = duplicate_task(replay->graph->tasks[node]);
+    task_header(task)->in_taskgroup = replay->in_taskgroup;
+    hpx::applier::register_thread_nullary(
+        std::bind(&run_replayed_task, replay, node, task),
+        "omp_replayed_task", hpx::threads::pending, true,
+        task_priority(task, replay->parent.get()));
+}
+
+// Returns whether the region has to run, either to be recorded or because
+// it cannot be replayed. Otherwise the recorded tasks have been started.
+bool hpx_runtime::start_record_task( int gtid, int graph_id, bool nowait, bool re_record )
+{
+    omp_task_data *task = current_task();
+    if(!nowait) {
+        start_taskgroup();
+    }
+    //nested regions are not recorded, the enclosing one is not replayed
+    if(task->ext && task->ext->recording) {
+        taskgraph_not_replayable(task);
+        return true;
+    }
+    task_graph *graph;
+    {
+        std::lock_guard<mutex_type> lk(task_graph_mtx);
+        auto &slot = task_graphs[graph_id];
+        if(slot && re_record && slot->state.load(std::memory_order_acquire) != task_graph::recording) {
+            retired_task_graphs.push_back(std::move(slot));
+        }
+        if(!slot) {
+            slot.reset(new task_graph);
+            task->get_ext().recording = slot.get();
+            return true;
+        }
+        graph = slot.get();
+    }
+    //another task is still recording it, or it cannot be replayed
+    if(graph->state.load(std::memory_order_acquire) != task_graph::ready) {
+        return true;
+    }
+
+    std::uint32_t n = static_cast<std::uint32_t>(graph->tasks.size());
+    if(n == 0) {
+        return false;
+    }
+    //like the tasks it recorded, a team of one or a final task runs the
+    // graph inline. Nodes are numbered in creation order, which every edge
+    // follows, so that order is a topological one.
+    if(task->team->num_threads == 1 || task->final_task) {
+        for(std::uint32_t i = 0; i < n; i++) {
+            kmp_task_t *copy = duplicate_task(graph->tasks[i]);
+            execute_task_inline(gtid, copy, task);
+            free_task(copy);
+        }
+        return false;
+    }
+    task_graph_replay *replay = new task_graph_replay;
+    replay->graph = graph;
+    replay->parent.reset(task);
+    replay->gtid = gtid;
+    replay->in_taskgroup = task->in_taskgroup;
+    replay->pending.reset(new atomic<std::uint32_t>[n]);
+    for(std::uint32_t i = 0; i < n; i++) {
+        replay->pending[i].store(graph->num_predecessors[i], std::memory_order_relaxed);
+    }
+    replay->remaining.store(n, std::memory_order_relaxed);
+    omp_task_ext &ext = task->get_ext();
+
+    //siblings created before the region that are not done yet hold back the
+    // nodes that depend on them, like they would the recorded tasks
+    vector<std::pair<std::uint32_t, vector<shared_future<void>>>> waiting;
+    if(ext.df_map.size() != 0) {
+        for(std::uint32_t i = 0; i < n; i++) {
+            task_predecessors preds;
+            for(std::uint32_t d = graph->dep_begin[i]; d < graph->dep_begin[i + 1]; d++) {
+                ext.df_map.predecessors(graph->deps[d].first, graph->deps[d].second, preds);
+            }
+            if(preds.count == 0) {
+                continue;
+            }
+            vector<shared_future<void>> futures(preds.first, preds.first + std::min<std::size_t>(preds.count, 2));
+            futures.insert(futures.end(), preds.rest.begin(), preds.rest.end());
+            waiting.emplace_back(i, std::move(futures));
+            replay->pending[i].fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    //siblings created after a nowait replay depend on its last readers and
+    // writers, taken before any node runs as the replay goes away with them
+    vector<shared_future<void>> finished;
+    if(nowait && graph->num_final != 0) {
+        replay->finished.reset(new hpx::lcos::local::promise<void>[graph->num_final]);
+        finished.reserve(graph->num_final);
+        for(std::uint32_t i = 0; i < graph->num_final; i++) {
+            finished.push_back(replay->finished[i].get_future().share());
+        }
+    }
+
+    ext.child_created(task->in_taskgroup, n);
+    task->team->teamTasks.created(n);
+    //no node has run yet, a root is either free or waits for a sibling
+    for(std::uint32_t root : graph->roots) {
+        if(replay->pending[root].load(std::memory_order_relaxed) == 0) {
+            spawn_replayed_task(replay, root);
+        }
+    }
+    for(auto &w : waiting) {
+        dataflow(hpx::launch::sync, &replayed_task_ready, replay, w.first, std::move(w.second));
+    }
+    if(!finished.empty()) {
+        for(auto const &f : graph->final_accesses) {
+            if(f.last_out >= 0) {
+                ext.df_map.record(f.addr, true, finished[graph->final_index[f.last_out]]);
+            }
+            for(std::uint32_t r = f.readers_begin; r < f.readers_end; r++) {
+                ext.df_map.record(f.addr, false, finished[graph->final_index[graph->final_readers[r]]]);
+            }
+        }
+    }
+    return false;
+}
+
+void hpx_runtime::end_record_task( int gtid, int graph_id, bool nowait )
+{
+    omp_task_data *task = current_task();
+    if(task->ext && task->ext->recording) {
+        task_graph *graph = task->ext->recording;
+        bool ours;
+        {
+            std::lock_guard<mutex_type> lk(task_graph_mtx);
+            auto it = task_graphs.find(graph_id);
+            ours = it != task_graphs.end() && it->second.get() == graph;
+        }
+        if(ours) {
+            task->ext->recording = nullptr;
+            graph->finish();
+        }
+    }
+    if(!nowait) {
+        end_taskgroup();
+    }
+}
+
+//runs once the futures of the predecessors are ready
+template <typename... Deps>
+void df_task_wrapper( int gtid, kmp_task_t *task, intrusive_ptr<omp_task_data> parent_task_ptr,
+                      Deps const&... deps)
 {
     task_setup( gtid, task, parent_task_ptr);
 }
@@ -387,39 +1616,52 @@ void df_tg_task_wrapper( int gtid, kmp_task_t *task, omp_icv icv,
 
 // The input on the Intel call is a pair of pointers to arrays of dep structs,
 // and the length of these arrays.
-// The structs contain a pointer and a flag for in or out dep
+// The structs contain a pointer and a flag for in or out dep. An address
+// with both flags set is an inout dependence and treated as out.
 void hpx_runtime::create_df_task( int gtid, kmp_task_t *thunk,
                            int ndeps, kmp_depend_info_t *dep_list,
                            int ndeps_noalias, kmp_depend_info_t *noalias_dep_list )
 {
     auto current_task_ptr = get_task_data();
     auto team = current_task_ptr->team;
-    vector<shared_future<void>> dep_futures;
-    dep_futures.reserve( ndeps + ndeps_noalias);
+    if(current_task_ptr->ext && current_task_ptr->ext->recording) {
+        current_task_ptr->ext->recording->record(thunk, ndeps, dep_list, ndeps_noalias, noalias_dep_list);
+    }
+    //all earlier siblings already ran inline, so the dependences are met
+    if(team->num_threads == 1 || current_task_ptr->final_task) {
+        execute_task_inline(gtid, thunk, current_task_ptr.get());
+        free_task(thunk);
+        return;
+    }
+    omp_task_ext &ext = current_task_ptr->get_ext();
+    depends_map &df_map = ext.df_map;
 
-    //Populating a vector of futures that the task depends on
+    //the unfinished tasks this one depends on
+    task_predecessors preds;
     for(int i = 0; i < ndeps;i++) {
-        if(current_task_ptr->df_map.count( dep_list[i].base_addr) > 0) {
-            dep_futures.push_back(current_task_ptr->df_map[dep_list[i].base_addr]);
-        }
+        df_map.predecessors(dep_list[i].base_addr, dep_list[i].flags.out, preds);
     }
     for(int i = 0; i < ndeps_noalias;i++) {
-        if(current_task_ptr->df_map.count( noalias_dep_list[i].base_addr) > 0) {
-            dep_futures.push_back(current_task_ptr->df_map[noalias_dep_list[i].base_addr]);
-        }
+        df_map.predecessors(noalias_dep_list[i].base_addr, noalias_dep_list[i].flags.out, preds);
     }
 
     shared_future<void> new_task;
 
-    if(current_task_ptr->in_taskgroup) {
-        current_task_ptr->taskgroupLatch->count_up(1);
-    } else {
-        current_task_ptr->taskLatch.count_up(1);
+    //a task that extends the longest chain of unfinished siblings is on the
+    // critical path, it goes ahead of the ones that can wait
+    hpx::threads::thread_priority priority = task_priority(thunk, current_task_ptr.get());
+    if(critical_path_priority && preds.depth > 0 && preds.depth >= ext.max_depth) {
+        ext.max_depth = preds.depth;
+        priority = hpx::threads::thread_priority_high;
     }
+    hpx::launch::async_policy policy(priority);
+
+    task_header(thunk)->in_taskgroup = current_task_ptr->in_taskgroup;
+    ext.child_created(current_task_ptr->in_taskgroup);
 #ifndef OMP_COMPLIANT
-    team->teamTaskLatch.count_up(1);
+    team->teamTasks.created();
 #endif
-    if(dep_futures.size() == 0) {
+    if(preds.count == 0) {
 #ifdef OMP_COMPLIANT
         if(task->in_taskgroup) {
             new_task = hpx::async( *(task->tg_exec), tg_task_setup, gtid, thunk, task->icv,
@@ -429,13 +1671,15 @@ void hpx_runtime::create_df_task( int gtid, kmp_task_t *thunk,
                                     task->num_child_tasks, team);
         }
 #else
-        new_task = hpx::async(task_setup, gtid, thunk, current_task_ptr);
+        new_task = hpx::async(policy, task_setup, gtid, thunk, current_task_ptr);
 #endif
     } else {
 
 
 #ifdef OMP_COMPLIANT
         //shared_future<shared_ptr<local_priority_queue_executor>> tg_exec = hpx::make_ready_future(task->tg_exec);
+        vector<shared_future<void>> dep_futures(preds.first, preds.first + std::min<std::size_t>(preds.count, 2));
+        dep_futures.insert(dep_futures.end(), preds.rest.begin(), preds.rest.end());
 
         if(task->in_taskgroup) {
             new_task = dataflow( *(task->tg_exec),
@@ -449,110 +1693,99 @@ void hpx_runtime::create_df_task( int gtid, kmp_task_t *thunk,
                                  team, hpx::when_all(dep_futures) );
         }
 #else
-        new_task = dataflow( unwrapping(df_task_wrapper), gtid, thunk, current_task_ptr, hpx::when_all(dep_futures));
+        if(preds.count == 1) {
+            new_task = dataflow( policy, &df_task_wrapper<shared_future<void>>, gtid, thunk,
+                                 current_task_ptr, preds.first[0] );
+        } else if(preds.count == 2) {
+            new_task = dataflow( policy, &df_task_wrapper<shared_future<void>, shared_future<void>>,
+                                 gtid, thunk, current_task_ptr,
+                                 preds.first[0], preds.first[1] );
+        } else {
+            preds.rest.push_back(std::move(preds.first[0]));
+            preds.rest.push_back(std::move(preds.first[1]));
+            new_task = dataflow( policy, &df_task_wrapper<vector<shared_future<void>>>, gtid, thunk,
+                                 current_task_ptr, std::move(preds.rest) );
+        }
 #endif
     }
     for(int i = 0 ; i < ndeps; i++) {
-        if(dep_list[i].flags.out) {
-            current_task_ptr->df_map[dep_list[i].base_addr] = new_task;
-        }
+        df_map.record(dep_list[i].base_addr, dep_list[i].flags.out, new_task, preds.depth);
     }
     for(int i = 0 ; i < ndeps_noalias; i++) {
-        if(noalias_dep_list[i].flags.out) {
-            current_task_ptr->df_map[noalias_dep_list[i].base_addr] = new_task;
-        }
+        df_map.record(noalias_dep_list[i].base_addr, noalias_dep_list[i].flags.out, new_task, preds.depth);
     }
     //task->last_df_task = new_task;
 }
 
 #ifdef FUTURIZE_TASKS
 //This is for the unfinished compiler work for adding futures to OpenMP
-raw_data future_wrapper( int gtid, kmp_task_t *task, raw_data arg1)
-{
-    memcpy( (task->shareds), arg1.data, arg1.size);
-
-    task->routine(gtid, task);
-
-    delete[] (char*)task;
-
-    return arg1;
-}
-
-//I don't have access to which variable is output, assuming it's the first one for now.
-raw_data future_wrapper2( int gtid, kmp_task_t *task, raw_data arg1, raw_data arg2)
-{
-    memcpy((task->shareds)            , arg1.data, arg1.size);
-    memcpy((task->shareds) + arg1.size, arg2.data, arg2.size);
-
-    task->routine(gtid, task);
-
-    delete[] (char*)task;
-
-    memcpy(arg1.data, (task->shareds), arg1.size);
-    return arg1;
-}
-
-raw_data future_wrapper3( int gtid, kmp_task_t *task, raw_data arg1, raw_data arg2, raw_data arg3)
+//
+// The shareds of a futurized task hold one pointer per dependence, in the
+// order of the depend clause, which is pointed at the payload of the
+// variable. The output, the dependence with the out flag, gets a buffer of
+// its own that becomes the next version of its variable; it starts as a
+// copy of the previous version only if the task also reads it.
+raw_data future_wrapper( int gtid, kmp_task_t *task, intrusive_ptr<omp_task_data> parent,
+                         int output, bool output_read,
+                         vector<shared_future<raw_data>> inputs )
 {
-    memcpy((task->shareds),
-            arg1.data, arg1.size);
-    memcpy((task->shareds) + arg1.size,
-            arg2.data, arg2.size);
-    memcpy((task->shareds) + arg1.size + arg3.size,
-            arg3.data, arg3.size);
-
-    task->routine(gtid, task);
-
-    delete[] (char*)task;
-
-    memcpy(arg1.data, (task->shareds), arg1.size);
-    return arg1;
+    void **args = reinterpret_cast<void**>(task->shareds);
+    raw_data result;
+    for(std::size_t i = 0; i < inputs.size(); i++) {
+        raw_data const &input = inputs[i].get();
+        if(static_cast<int>(i) == output) {
+            result.reset(raw_buffer::create(input->size));
+            if(output_read) {
+                memcpy(result->data(), input->data(), input->size);
+            }
+            args[i] = result->data();
+        } else {
+            args[i] = input->data();
+        }
+    }
+    run_task(gtid, task, parent.get());
+    free_task(task);
+    //the inputs go out of scope here, dropping our hold on their buffers
+    return result;
 }
 
 void hpx_runtime::create_future_task( int gtid, kmp_task_t *thunk,
                                       int ndeps, kmp_depend_info_t *dep_list)
 {
-    shared_future<raw_data> *output_future;
-    vector<shared_future<raw_data>*> input_futures(ndeps);
+    auto current_task_ptr = get_task_data();
+    int output = -1;
+    vector<shared_future<raw_data>> input_futures(ndeps);
 
-    //if the variables are FP, then the data needs to be copied, if it's shared, then only
-    //pointers need to be set. working with the assumption/requirement that data is FP.
+    //dependences point at the cache of the variable, which holds the future
+    // of its latest version
     for(int i=0; i < ndeps; i++) {
-        input_futures[i] = (**(shared_future<raw_data>***)(dep_list[i].base_addr));
+        input_futures[i] = ***(shared_future<raw_data>***)(dep_list[i].base_addr);
         if(dep_list[i].flags.out ) {
-            output_future = (**(shared_future<raw_data>***)(dep_list[i].base_addr));
-        }
-    }
-
-    if(ndeps == 1) {
-        *(output_future) = dataflow( unwrapping(future_wrapper),
-                                                make_ready_future(gtid), make_ready_future(thunk),
-                                                *(input_futures[0]) );
-    } else if(ndeps == 2) {
-        *(output_future) = dataflow( unwrapping(future_wrapper2),
-                                                make_ready_future(gtid), make_ready_future(thunk),
-                                                *(input_futures[0]), *(input_futures[1]) );
-    } else if(ndeps == 3) {
-        *(output_future) = dataflow( unwrapping(future_wrapper3),
-                                                make_ready_future(gtid), make_ready_future(thunk),
-                                                *(input_futures[0]), *(input_futures[1]),
-                                                *(input_futures[2]) );
-    } else {
-        std::cerr << "too many dependencies for now" << endl;
+            output = i;
+        }
+    }
+    bool output_read = output >= 0 && dep_list[output].flags.in;
+
+    task_header(thunk)->in_taskgroup = current_task_ptr->in_taskgroup;
+    current_task_ptr->get_ext().child_created(current_task_ptr->in_taskgroup);
+    current_task_ptr->team->teamTasks.created();
+    shared_future<raw_data> result = dataflow( &future_wrapper, gtid, thunk, current_task_ptr,
+                                               output, output_read, std::move(input_futures) );
+    if(output >= 0) {
+        ***(shared_future<raw_data>***)(dep_list[output].base_addr) = result;
     }
 }
 #endif
 
 // --- start up for threads and parallel regions below --- //
 
-void thread_setup( invoke_func kmp_invoke, microtask_t thread_func,
-                   int argc, void **argv, int tid,
-                   parallel_region *team, intrusive_ptr<omp_task_data> parent,
-                   hpxmp_latch& threadLatch)
+// Runs the implicit task tid of team on the calling hpx thread.
+void implicit_task( invoke_func kmp_invoke, microtask_t thread_func,
+                    int argc, void **argv, int tid,
+                    parallel_region *team, intrusive_ptr<omp_task_data> parent)
 {
-    intrusive_ptr<omp_task_data> task_data_ptr(new omp_task_data(tid, team, parent.get()));
-
-    set_thread_data( get_self_id(), reinterpret_cast<size_t>(task_data_ptr.get()));
+    omp_task_data *task_data = team->implicit_task_data(tid, parent.get());
+    omp_task_data *encountering = exchange_current_task(task_data);
 
     if(argc == 0) { //note: kmp_invoke segfaults iff argc == 0
         thread_func(&tid, &tid);
@@ -586,16 +1819,216 @@ void thread_setup( invoke_func kmp_invoke, microtask_t thread_func,
     }
 #endif
 }
+    exchange_current_task(encountering);
+}
+
+void thread_setup( invoke_func kmp_invoke, microtask_t thread_func,
+                   int argc, void **argv, int tid,
+                   parallel_region *team, intrusive_ptr<omp_task_data> parent,
+                   hpxmp_latch& threadLatch)
+{
+    implicit_task(kmp_invoke, thread_func, argc, argv, tid, team, parent);
     threadLatch.count_down(1);
 }
 
+// Registers f(i) as an hpx thread on os thread i for every i in [first, last).
+// Ranges longer than fanout are cut into slices that are handed to spawner
+// threads, which do the same for their slice. The last thread of a large team
+// is registered after O(log N) instead of O(N) serial registrations.
+template <typename F>
+void spawn_tree(int first, int last, int fanout, char const* description, F f)
+{
+    while(last - first > fanout) {
+        int slice = (last - first + fanout - 1) / fanout;
+        for(int begin = first + slice; begin < last; begin += slice) {
+            hpx::applier::register_thread_nullary(
+                    std::bind( &spawn_tree<F>, begin, std::min(begin + slice, last),
+                               fanout, description, f ),
+                    "omp_implicit_spawner", hpx::threads::pending,
+                    true, hpx::threads::thread_priority_high, begin );
+        }
+        last = first + slice;
+    }
+    for(int i = first; i < last; i++) {
+        hpx::applier::register_thread_nullary(
+                [f, i]() { f(i); },
+                description, hpx::threads::pending,
+                true, hpx::threads::thread_priority_low, i );
+    }
+}
+
+bool park_signal::wait(std::uint64_t seen)
+{
+    high_resolution_timer spin_timer;
+    while(job.load(std::memory_order_acquire) == seen) {
+        if(stopped.load()) {
+            return false;
+        }
+        if(spin_timer.elapsed_microseconds() >= spin_time) {
+            std::unique_lock<mutex_type> l(mtx);
+            //sleepers is checked by post() after it publishes the job
+            ++sleepers;
+            cond.wait(l, [&]() {
+                return stopped.load() || job.load() != seen;
+            });
+            --sleepers;
+        } else {
+            hpx::this_thread::yield();
+        }
+    }
+    return !stopped.load();
+}
+
+void park_signal::post(int num_threads)
+{
+    std::uint64_t generation = (job.load(std::memory_order_relaxed) >> 32) + 1;
+    job.store((generation << 32) | static_cast<std::uint32_t>(num_threads));
+    if(sleepers.load() > 0) {
+        std::lock_guard<mutex_type> l(mtx);
+        cond.notify_all();
+    }
+}
+
+void park_signal::stop()
+{
+    stopped.store(true);
+    std::lock_guard<mutex_type> l(mtx);
+    cond.notify_all();
+}
+
+// The encountering thread is thread 0 of the team, only threads 1..N-1 are
+// kept parked.
+hot_team::hot_team(int num_threads, int depth, std::int64_t spin_time, int fanout)
+    : num_threads(num_threads), depth(depth), signal(spin_time),
+      exitLatch(num_threads)
+{
+    hot_team *self = this;
+    spawn_tree(1, num_threads, fanout, "omp_hot_team_worker",
+               [self](int tid) { self->worker_loop(tid); });
+}
+
+hot_team::~hot_team()
+{
+    stop_workers();
+}
+
+void hot_team::stop_workers()
+{
+    signal.stop();
+    exitLatch.count_down_and_wait();
+}
+
+// A worker that is not needed by a job skips it. The job stays published until
+// every worker it needs is done, so a worker that wakes up late sees either
+// that job or a later one, together with its thread count.
+void hot_team::worker_loop(int tid)
+{
+    std::uint64_t seen = 0;
+    while(signal.wait(seen)) {
+        seen = signal.current();
+        if(tid < park_signal::job_threads(seen)) {
+            thread_setup( job.kmp_invoke, job.thread_func, job.argc, job.argv, tid,
+                          job.team, job.parent, *job.threadLatch );
+        }
+    }
+    exitLatch.count_down(1);
+}
+
+void hot_team::run( invoke_func kmp_invoke, microtask_t thread_func,
+                    int argc, void **argv, parallel_region *team,
+                    intrusive_ptr<omp_task_data> parent, hpxmp_latch &threadLatch )
+{
+    job.kmp_invoke = kmp_invoke;
+    job.thread_func = thread_func;
+    job.argc = argc;
+    job.argv = argv;
+    job.team = team;
+    job.parent = parent;
+    job.threadLatch = &threadLatch;
+    signal.post(team->num_threads);
+}
+
+// Returns a hot team of at least the requested size, or nullptr if the region
+// has to spawn its own threads. A smaller team at the same depth is replaced.
+hot_team* hpx_runtime::acquire_hot_team(int depth, int num_threads)
+{
+    if(!use_hot_teams || num_threads < 2 || depth < 1 || depth > hot_teams_max_level) {
+        return nullptr;
+    }
+    shared_ptr<hot_team> old_team;
+    hot_team *result;
+    {
+        std::lock_guard<mutex_type> l(hot_team_mtx);
+        auto &slot = hot_teams[depth - 1];
+        if(slot && !slot->try_acquire()) {
+            return nullptr;
+        }
+        if(slot && slot->num_threads >= num_threads) {
+            return slot.get();
+        }
+        //the old team is acquired, so nobody else touches it anymore
+        old_team = slot;
+        slot.reset(new hot_team(num_threads, depth, spin_time, spawn_fanout(num_threads)));
+        slot->try_acquire();
+        result = slot.get();
+    }
+    //stopping waits on the workers, do not hold the spinlock for that
+    old_team.reset();
+    return result;
+}
+
+// Teams smaller than the tree fork threshold are spawned by one serial loop.
+int hpx_runtime::spawn_fanout(int num_threads) const
+{
+    if(num_threads >= tree_fork_threshold) {
+        return tree_fork_fanout;
+    }
+    return std::max(num_threads, 1);
+}
+
+void hpx_runtime::release_hot_team(hot_team *team)
+{
+    team->release();
+}
+
+// Starts implicit tasks 1..N-1 of team, on the hot team of its depth if
+// there is one. Returns that hot team, which is released after the join.
+hot_team* start_team_threads( invoke_func kmp_invoke, microtask_t thread_func,
+                              int argc, void **argv, parallel_region &team,
+                              intrusive_ptr<omp_task_data> parent, hpxmp_latch &threadLatch )
+{
+    int running_threads = team.num_threads;
+    hot_team *hot = hpx_backend->acquire_hot_team(team.depth, running_threads);
+    if(hot) {
+        hot->run(kmp_invoke, thread_func, argc, argv, &team, parent, threadLatch);
+        return hot;
+    }
+#if HPXMP_HAVE_POOL
+    hpx_backend->TPool.enlarge(running_threads);
+    for( int i = 1; i < running_threads; i++ ) {
+        hpx_backend->TPool.enqueue( &thread_setup, kmp_invoke, thread_func, argc, argv, i, &team, parent,
+                                    boost::ref(threadLatch));
+    }
+#else
+    parallel_region *team_ptr = &team;
+    hpxmp_latch *latch_ptr = &threadLatch;
+    spawn_tree(1, running_threads, hpx_backend->spawn_fanout(running_threads),
+               "omp_implicit_task",
+               [=](int tid) {
+                   thread_setup(kmp_invoke, thread_func, argc, argv, tid,
+                                team_ptr, parent, *latch_ptr);
+               });
+#endif
+    return nullptr;
+}
+
 // This is the only place where get_thread can't be called, since
 // that data is not initialized for the new hpx threads yet.
 void fork_worker( invoke_func kmp_invoke, microtask_t thread_func,
                   int argc, void **argv,
                   intrusive_ptr<omp_task_data> parent)
 {
-    parallel_region team(parent->team, parent->threads_requested);
+    parallel_region &team = *hpx_backend->acquire_region(parent->team, parent->threads_requested);
 #if HPXMP_HAVE_OMPT
     //TODO:HOW TO FIND OUT INVOKER
     ompt_invoker_t a = ompt_invoker_runtime;
@@ -613,26 +2046,22 @@ void fork_worker( invoke_func kmp_invoke, microtask_t thread_func,
     team.exec.reset(new local_priority_queue_executor(parent->threads_requested));
 #endif
     int running_threads = parent->threads_requested;
-    hpxmp_latch threadLatch(running_threads+1);
-#if HPXMP_HAVE_POOL
-    hpx_backend->TPool.enlarge(running_threads);
-    for( int i = 0; i < running_threads; i++ ) {
-        hpx_backend->TPool.enqueue( &thread_setup, kmp_invoke, thread_func, argc, argv, i, &team, parent,
-                                    boost::ref(threadLatch));
+    //the encountering thread runs implicit task 0 itself, see below
+    hpxmp_latch threadLatch(running_threads);
+    hot_team *hot = nullptr;
+    if(running_threads > 1) {
+        hot = start_team_threads(kmp_invoke, thread_func, argc, argv, team, parent, threadLatch);
     }
-#else
-    for( int i = 0; i < parent->threads_requested; i++ ) {
-        hpx::applier::register_thread_nullary(
-                std::bind( &thread_setup, kmp_invoke, thread_func, argc, argv, i, &team, parent,
-                           boost::ref(threadLatch)),
-                "omp_implicit_task", hpx::threads::pending,
-                true, hpx::threads::thread_priority_low, i );
-                //true, hpx::threads::thread_priority_normal, i );
+    implicit_task(kmp_invoke, thread_func, argc, argv, 0, &team, parent);
+    //a team of one has nobody to wait for and runs its tasks inline
+    if(running_threads > 1) {
+        threadLatch.count_down_and_wait();
+        // wait for all the tasks in the team to finish
+        wait_team_tasks(0, &team);
+    }
+    if(hot) {
+        hpx_backend->release_hot_team(hot);
     }
-#endif
-    threadLatch.count_down_and_wait();
-    // wait for all the tasks in the team to finish
-    team.teamTaskLatch.wait();
 #if HPXMP_HAVE_OMPT
     if (ompt_enabled.ompt_callback_parallel_end) {
         ompt_callbacks.ompt_callback(ompt_callback_parallel_end)(
@@ -640,16 +2069,84 @@ void fork_worker( invoke_func kmp_invoke, microtask_t thread_func,
                 __builtin_return_address(0));
     }
 #endif
+    hpx_backend->release_region(&team);
+}
+
+fork_handoff::fork_handoff(std::int64_t spin_time)
+    : signal(spin_time), exitLatch(2)
+{
+    fork_handoff *self = this;
+    hpx::applier::register_thread_nullary(
+            [self]() { self->worker_loop(); },
+            "omp_fork_handoff", hpx::threads::pending,
+            true, hpx::threads::thread_priority_high );
+}
+
+fork_handoff::~fork_handoff()
+{
+    signal.stop();
+    exitLatch.count_down_and_wait();
+}
+
+void fork_handoff::worker_loop()
+{
+    std::uint64_t seen = 0;
+    while(signal.wait(seen)) {
+        seen = signal.current();
+        fork_worker(kmp_invoke, thread_func, argc, argv, parent);
+        parent.reset();
+        {
+            std::lock_guard<std::mutex> l(done_mtx);
+            done = true;
+        }
+        done_cond.notify_one();
+    }
+    exitLatch.count_down(1);
+}
+
+void fork_handoff::run( invoke_func kmp_invoke, microtask_t thread_func,
+                        int argc, void **argv, intrusive_ptr<omp_task_data> parent )
+{
+    this->kmp_invoke = kmp_invoke;
+    this->thread_func = thread_func;
+    this->argc = argc;
+    this->argv = argv;
+    this->parent = parent;
+    signal.post(1);
+    {
+        std::unique_lock<std::mutex> l(done_mtx);
+        done_cond.wait(l, [this]() { return done; });
+        done = false;
+    }
+    busy.store(false, std::memory_order_release);
+}
+
+// Returns the handoff for a fork of a thread that is not an hpx thread, or
+// nullptr if it is in use. Like hot teams it is off when the application owns
+// the hpx runtime.
+fork_handoff* hpx_runtime::acquire_fork_handoff()
+{
+    if(!use_hot_teams) {
+        return nullptr;
+    }
+    std::lock_guard<mutex_type> l(hot_team_mtx);
+    if(!external_fork) {
+        external_fork.reset(new fork_handoff(spin_time));
+    }
+    return external_fork->try_acquire() ? external_fork.get() : nullptr;
 }
 
 //TODO: This can make main an HPX high priority thread
-//TODO: according to the spec, the current thread should be thread 0 of the new team, and execute the new work.
 void hpx_runtime::fork(invoke_func kmp_invoke, microtask_t thread_func, int argc, void** argv)
 {
     auto current_task_ptr = get_task_data();
 
+    //the region runs on an hpx thread even for a team of one, waiting on a
+    // task or yielding is not possible on other threads
     if( hpx::threads::get_self_ptr() ) {
         fork_worker(kmp_invoke, thread_func, argc, argv, current_task_ptr);
+    } else if( fork_handoff *handoff = acquire_fork_handoff() ) {
+        handoff->run(kmp_invoke, thread_func, argc, argv, current_task_ptr);
     } else {
         //this handles the sync for hpx threads.
         hpx::threads::run_as_hpx_thread(&fork_worker,kmp_invoke, thread_func, argc, argv,
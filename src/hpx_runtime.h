@@ -6,11 +6,16 @@
 //  file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
 #include <limits>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
+#include <chrono>
+#include <memory>
+#include <unordered_map>
 
 #include <hpx/hpx.hpp>
 #include <hpx/hpx_start.hpp>
@@ -32,10 +37,10 @@
 //#include <boost/thread/condition.hpp>
 
 #include <hpx/timing/high_resolution_timer.hpp>
-#include <map>
 
 #include "icv-vars.h"
 #include "ompt.h"
+#include "task_allocator.h"
 #if HPXMP_HAVE_POOL
 #include "thread_pool.h"
 #endif
@@ -67,28 +72,138 @@ typedef boost::shared_ptr<mutex_type> mtx_ptr;
 
 typedef int (* kmp_routine_entry_t)( int, void * );
 
-typedef std::map<int64_t, hpx::shared_future<void>> depends_map;
+// unfinished tasks a new task has to wait for. Most tasks have one or two,
+// those are kept without a heap allocation.
+struct task_predecessors {
+    shared_future<void> first[2];
+    vector<shared_future<void>> rest;
+    std::size_t count{0};
+    //length of the longest chain of unfinished tasks ending in the new one
+    std::uint32_t depth{0};
 
+    void add(shared_future<void> const &f, std::uint32_t pred_depth)
+    {
+        depth = std::max(depth, pred_depth + 1);
+        if(count < 2) {
+            first[count] = f;
+        } else {
+            rest.push_back(f);
+        }
+        count++;
+    }
+};
+
+// The dependences recorded by the children of one task, an open addressing
+// table keyed by address. An entry holds the last task with an out
+// dependence on the address and the in dependences since. Finished tasks are
+// dropped when the entry is looked up again, entries that end up empty are
+// dropped when the table is rehashed. Only the owning task uses it.
+class depends_map {
+    public:
+        // adds the tasks a new in (or out) dependence on addr has to wait for
+        void predecessors(int64_t addr, bool out, task_predecessors &preds);
+        // records task as the latest reader (or writer) of addr
+        void record(int64_t addr, bool out, shared_future<void> const &task,
+                    std::uint32_t depth = 0);
+        void clear();
+        std::size_t size() const { return used; }
+
+    private:
+        struct entry {
+            bool used{false};
+            int64_t addr{0};
+            shared_future<void> last_out;
+            vector<shared_future<void>> readers;
+            //dependence depth of last_out, and the deepest of the readers
+            std::uint32_t out_depth{0};
+            std::uint32_t readers_depth{0};
+        };
+
+        static bool prune(entry &e);
+        std::size_t slot(int64_t addr) const;
+        entry* find(int64_t addr);
+        entry& insert(int64_t addr);
+        void rehash();
+
+        //power of two, at most three quarters used
+        vector<entry> slots;
+        std::size_t used{0};
+};
+
+typedef union kmp_cmplrdata {
+    int                 priority;
+    kmp_routine_entry_t destructors;
+} kmp_cmplrdata_t;
+
+//layout is shared with the compiler, private variables follow it
 struct kmp_task_t {
     void *              shareds;
     kmp_routine_entry_t routine;
     int                 part_id;
-    bool                gcc;
+    kmp_cmplrdata_t     data1;
+    kmp_cmplrdata_t     data2;
+};
+
+class omp_task_data;
+
+//runtime bookkeeping, placed right in front of every kmp_task_t so that
+// nothing the compiler writes into the task can clobber it
+struct alignas(16) kmp_task_header_t {
     atomic<int> pointer_counter;
-#if OMP_40_ENABLED
-    kmp_routine_entry_t destructors;
-#endif
+    //worker that deferred the task, see task_throttle
+    std::uint32_t spawner;
+    //current task of the encountering thread while an if(0) task runs
+    omp_task_data *encountering;
+    //bytes behind the header, kmp_task_t and shareds
+    std::uint32_t size;
+    bool        gcc;
+    //created inside a taskgroup of its parent, see omp_task_ext
+    bool        in_taskgroup;
+    //set by whoever runs a deferred task, its hpx thread or a waiting thread
+    atomic<bool> claimed;
+    //decoded from the tasking flags of the compiler
+    bool        final;
+    bool        untied;
+    bool        has_priority;
 };
 
+inline kmp_task_header_t* task_header(kmp_task_t *task)
+{
+    return reinterpret_cast<kmp_task_header_t*>(task) - 1;
+}
+
+//header, task and shareds all come from one block of the task allocator
+inline kmp_task_t* allocate_task(std::size_t size)
+{
+    void *block = task_allocator::get_instance().allocate(sizeof(kmp_task_header_t) + size);
+    kmp_task_header_t *header = new (block) kmp_task_header_t;
+    header->pointer_counter = 0;
+    header->spawner = ~std::uint32_t(0);
+    header->encountering = nullptr;
+    header->size = static_cast<std::uint32_t>(size);
+    header->gcc = false;
+    header->in_taskgroup = false;
+    header->claimed = false;
+    header->final = false;
+    header->untied = false;
+    header->has_priority = false;
+    return reinterpret_cast<kmp_task_t*>(header + 1);
+}
+
+inline void free_task(kmp_task_t *task)
+{
+    task_allocator::get_instance().deallocate(task_header(task));
+}
+
 inline void intrusive_ptr_add_ref(kmp_task_t *x)
 {
-    ++x->pointer_counter;
+    ++task_header(x)->pointer_counter;
 }
 
 inline void intrusive_ptr_release(kmp_task_t *x)
 {
-    if (x->pointer_counter == 0)
-        delete x;
+    if (--task_header(x)->pointer_counter == 0)
+        free_task(x);
 }
 
 
@@ -110,13 +225,14 @@ struct kmp_task_red_flags_t {
 // internal structure for reduction data item related info
 struct kmp_task_red_data_t {
     void *reduce_shar; // shared reduction item
-    size_t reduce_size; // size of data item
-    void *reduce_priv; // thread specific data
+    size_t reduce_size; // size of data item, padded to a cache line
+    void *reduce_priv; // worker specific data
     void *reduce_pend; // end of private data for comparison op
     void *reduce_init; // data initialization routine
     void *reduce_fini; // data finalization routine
     void *reduce_comb; // data combiner routine
     kmp_task_red_flags_t flags; // flags for additional info from compiler
+    std::atomic<bool> *reduce_busy; // per copy, set while a task holds it
 };
 
 // structure sent us by compiler - one per reduction item
@@ -129,14 +245,27 @@ struct kmp_task_red_input_t {
     kmp_task_red_flags_t flags; // flags for additional info from compiler
 };
 
+struct kmp_taskgroup_t;
+void intrusive_ptr_add_ref(kmp_taskgroup_t *x);
+void intrusive_ptr_release(kmp_taskgroup_t *x);
+
 struct kmp_taskgroup_t {
     std::atomic<int> count; // number of allocated and incomplete tasks
     std::atomic<int>
             cancel_request; // request for cancellation of this taskgroup
-     kmp_taskgroup_t* parent; // parent taskgroup
+    intrusive_ptr<kmp_taskgroup_t> parent; // enclosing taskgroup of the same task
     // Block of data to perform task reduction
-    shared_ptr<vector<kmp_task_red_data_t>> reduce_data; // reduction related info
+    vector<kmp_task_red_data_t> reduce_data; // reduction related info
     int reduce_num_data; // number of data items to reduce
+    // reduce_data positions by shared address, open addressing, -1 is empty
+    vector<int> reduce_index;
+    // regular private copies per item, one for every hpx worker
+    std::size_t reduce_nth;
+    // copies made while all regular copies of their item were held, as item
+    // index and copy. The ones no task holds are also in reduce_extra_free.
+    mutex_type reduce_extra_mtx;
+    vector<std::pair<int, void *>> reduce_extra;
+    vector<std::pair<int, void *>> reduce_extra_free;
     atomic<int> pointer_counter;
 };
 
@@ -147,19 +276,37 @@ inline void intrusive_ptr_add_ref(kmp_taskgroup_t *x)
 
 inline void intrusive_ptr_release(kmp_taskgroup_t *x)
 {
-    if (x->pointer_counter == 0)
+    if (--x->pointer_counter == 0)
         delete x;
 }
 
 #endif
 
+struct auto_loop_stats;
+
+// Descriptor of a worksharing loop, one slot of the loop ring of a team.
+// The first thread to reach a loop sets the slot up with init, the per
+// thread vectors are sized once for the team.
 class loop_data {
     public:
-        loop_data(int NT, int L, int U, int S, int C, int sched)
-            : lower(L), upper(U), stride(S), chunk(C), num_threads(NT),
-              schedule(sched), total_iter(0),
-              first_iter(NT,0), last_iter(NT,0), iter_count(NT,0)
+        void set_threads(int NT)
+        {
+            num_threads = NT;
+            first_iter.assign(NT, 0);
+            last_iter.assign(NT, 0);
+            iter_count.assign(NT, 0);
+            steal_ranges = make_aligned_array<steal_range>(NT);
+        }
+        void init(int L, int U, int S, int C, int sched)
         {
+            lower = L;
+            upper = U;
+            stride = S;
+            chunk = C;
+            schedule = sched;
+            ordered_count = 0;
+            schedule_count = 0;
+            auto_stats = nullptr;
             if( stride == 0) {
                 total_iter = (upper - lower) + 1;
             } else if( stride > 0) {
@@ -168,14 +315,6 @@ class loop_data {
                 total_iter = (lower - upper) / -stride + 1;
             }
         }
-        loop_data(const loop_data &other)
-            : loop_data( other.num_threads, other.lower, other.upper,
-                         other.stride, other.chunk, other.schedule )
-        { }
-
-        loop_data operator=(const loop_data &other) {
-            return loop_data(other);
-        }
 
         void yield(){ hpx::this_thread::yield(); }
         int lower;
@@ -186,10 +325,33 @@ class loop_data {
         atomic<int> schedule_count{0};
         int num_threads;
         int schedule;
-        int total_iter;
+        int total_iter{0};
         std::vector<int> first_iter;
         std::vector<int> last_iter;
         std::vector<int> iter_count;
+        //static_steal: the iterations [lower, upper) a thread has not taken
+        // yet, both packed into one word and on a cache line of their own
+        struct alignas(64) steal_range {
+            void set(std::uint32_t lower, std::uint32_t upper) {
+                bounds.store(pack(lower, upper), std::memory_order_release);
+            }
+            static std::uint64_t pack(std::uint32_t lower, std::uint32_t upper) {
+                return (static_cast<std::uint64_t>(upper) << 32) | lower;
+            }
+            atomic<std::uint64_t> bounds{0};
+        };
+        aligned_array<steal_range> steal_ranges;
+        //schedule(auto): the call site statistics to update once every
+        // thread left the loop, the choice made for this run and its timing
+        auto_loop_stats *auto_stats{nullptr};
+        int auto_choice{0};
+        std::uint64_t start_time{0};
+        atomic<std::uint64_t> first_finish{0};
+        //2n while the slot is free for loop n, 2n + 1 while it is set up and
+        // 2n + 2 once threads can take chunks
+        atomic<unsigned> seq{0};
+        //threads that got their last chunk of the current loop
+        atomic<int> finished{0};
 };
 
 //temp solution for cout_up does not allow starting from 0 in HPX
@@ -205,14 +367,114 @@ public:
     }
 };
 
+// Team wide count of unfinished explicit tasks. Creating and finishing a task
+// is counted on the shard of the worker doing it, so tasks spawned on many
+// workers do not all hit the same cache line. The shards are only summed up
+// when a barrier waits for the tasks of the team.
+class sharded_task_counter {
+    public:
+        explicit sharded_task_counter(std::size_t num_shards)
+            : shards(make_aligned_array<shard_data>(num_shards)), num_shards(num_shards)
+        {}
+
+        void created(std::uint64_t count = 1)
+        {
+            shard().created.fetch_add(count, std::memory_order_relaxed);
+        }
+        void completed()
+        {
+            shard().completed.fetch_add(1);
+            if(waiters.load() != 0 && pending() == 0) {
+                std::lock_guard<mutex_type> l(wait_mtx);
+                wait_cond.notify_all();
+            }
+        }
+        //zero only if there was a moment without unfinished tasks
+        std::uint64_t pending() const;
+        //suspends until pending() is zero
+        void wait();
+
+    private:
+        //both counts only grow, so a completion is never seen without the
+        // matching creation as long as completions are summed up first
+        //a cache line each, workers do not contend on their neighbours' counts
+        struct alignas(64) shard_data {
+            atomic<std::uint64_t> created{0};
+            atomic<std::uint64_t> completed{0};
+        };
+        shard_data& shard()
+        {
+            return shards[hpx::get_worker_thread_num() % num_shards];
+        }
+
+        aligned_array<shard_data> shards;
+        std::size_t num_shards;
+
+        atomic<int> waiters{0};
+        mutex_type wait_mtx;
+        hpx::lcos::local::condition_variable_any wait_cond;
+};
+
+// Decides whether an explicit task is deferred or run undeferred by the
+// encountering thread. Every worker counts the tasks it deferred that have
+// not finished yet. Once that count, or the count of all workers together,
+// reaches the limit, new tasks run right away, like libomp does when a task
+// deque is full. Long tasks lower the per worker limit to about backlog_ns
+// worth of work, so that deep recursions do not pile up hpx threads.
+class task_throttle {
+    public:
+        static const std::uint32_t untracked = ~std::uint32_t(0);
+
+        //a limit of 0 turns throttling off
+        void init(std::size_t num_workers, std::int64_t limit);
+
+        //records the spawning worker in the task header if it is deferred
+        bool defer_task(kmp_task_header_t *header);
+        void completed(std::uint32_t spawner, std::int64_t duration_ns);
+
+        static std::int64_t now()
+        {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+    private:
+        static const std::int64_t backlog_ns = 1000000;
+        static const std::int64_t min_limit = 16;
+        //how many tasks a worker defers before it sums up all workers
+        static const unsigned global_check_interval = 32;
+
+        //a cache line each, like the team task shards
+        struct alignas(64) worker_data {
+            atomic<std::int64_t> pending{0};
+            //moving average of the tasks finished on this worker
+            atomic<std::int64_t> avg_duration{0};
+            //only touched by the owning worker
+            std::int64_t global_pending{0};
+            unsigned spawned{0};
+        };
+
+        aligned_array<worker_data> workers;
+        std::size_t num_workers{0};
+        std::int64_t limit{0};
+};
+
+class omp_task_data;
+
 //Does this need to keep track of the parallel region it is nested in,
 // the omp_task_data of the parent thread, or both?
 //template<typename scheduler>
 struct parallel_region {
 
     parallel_region( int N ) : num_threads(N), globalBarrier(N),
-                               depth(0), reduce_data(N), teamTaskLatch(0)
-    {};
+                               depth(0), reduce_data(N), teamTasks(N),
+                               implicit_tasks(N)
+    {
+        for(int i = 0; i < loop_ring_size; i++) {
+            loop_ring[i].set_threads(N);
+            loop_ring[i].seq = 2 * i;
+        }
+    };
 
     parallel_region( parallel_region *parent, int threads_requested ) : parallel_region(threads_requested)
     {
@@ -222,6 +484,12 @@ struct parallel_region {
         parent_data = parent->parent_data;
 #endif
     }
+    ~parallel_region();
+
+    //prepares a cached region of the same size for the next fork
+    void reset( parallel_region *parent );
+    omp_task_data* implicit_task_data( int tid, omp_task_data *parent );
+
     int num_threads;
     //hpx::lcos::local::condition_variable_any cond;
     barrier globalBarrier;
@@ -233,9 +501,17 @@ struct parallel_region {
     atomic<int> current_single_thread{-1};
     void *copyprivate_data;
     vector<void*> reduce_data;
-    vector<loop_data> loop_list;
-    mutex_type loop_mtx;
-    hpxmp_latch teamTaskLatch;
+    //the loop_num-th loop of every thread uses slot loop_num % loop_ring_size,
+    // a thread that gets this many loops ahead waits for the others
+    static const int loop_ring_size = 8;
+    loop_data loop_ring[loop_ring_size];
+    sharded_task_counter teamTasks;
+    //implicit task data, reused by later forks of a cached region
+    vector<intrusive_ptr<omp_task_data>> implicit_tasks;
+    //slot in the region cache of hpx_runtime for its depth, -1 if not cached
+    int cache_index{-1};
+    //current task of the encountering thread of a serialized region
+    omp_task_data *encountering_task{nullptr};
 #if (HPXMP_HAVE_OMPT)
     ompt_data_t parent_data = ompt_data_none;
     ompt_data_t parallel_data = ompt_data_none;
@@ -246,6 +522,142 @@ struct parallel_region {
 };
 
 
+// The tasks a taskgraph region created, recorded the first time the region
+// runs. Every node holds a copy of its task as it was created, replaying the
+// graph runs copies of those once the node's predecessors are done. Only
+// tasks created by the encountering task itself are recorded, the tasks
+// they create run again as part of them.
+struct task_graph {
+    enum graph_state { recording, ready, not_replayable };
+
+    ~task_graph();
+    //adds task with its dependences, task stays with the caller
+    void record(kmp_task_t *task, int ndeps, kmp_depend_info_t *dep_list,
+                int ndeps_noalias, kmp_depend_info_t *noalias_dep_list);
+    //builds the static form once the region is done
+    void finish();
+
+    atomic<graph_state> state{recording};
+    vector<kmp_task_t*> tasks;
+    vector<std::uint32_t> num_predecessors;
+    //successors of node i are successors[successor_begin[i] .. successor_begin[i + 1])
+    vector<std::uint32_t> successor_begin;
+    vector<std::uint32_t> successors;
+    vector<std::uint32_t> roots;
+    //dependences of node i are deps[dep_begin[i] .. dep_begin[i + 1]), the
+    // address and whether it is an out dependence. A replay looks them up in
+    // the dependences of the encountering task, for siblings created before.
+    vector<std::uint32_t> dep_begin{0};
+    vector<std::pair<std::int64_t, bool>> deps;
+    //the last writer and the readers after it of every address, recorded
+    // for the siblings created after a nowait replay
+    struct final_access {
+        std::int64_t addr;
+        std::int64_t last_out;
+        std::uint32_t readers_begin;
+        std::uint32_t readers_end;
+    };
+    vector<final_access> final_accesses;
+    vector<std::uint32_t> final_readers;
+    //index of the nodes in final_accesses among them, -1 for the others
+    vector<std::int32_t> final_index;
+    std::uint32_t num_final{0};
+
+    private:
+        void add_edge(std::uint32_t from, std::uint32_t to);
+
+        //only while recording
+        struct access {
+            std::int64_t last_out{-1};
+            vector<std::uint32_t> readers;
+        };
+        std::unordered_map<int64_t, access> accesses;
+        vector<std::pair<std::uint32_t, std::uint32_t>> edges;
+};
+
+// marks the graph the current task records, if any, as one that cannot be
+// replayed, for constructs other than deferred tasks inside the region
+void taskgraph_not_replayable(omp_task_data *task);
+
+// The parts of a task context that most explicit tasks never use. They are
+// created by the owning task itself, the first time it creates a child task,
+// records a dependence or opens a taskgroup.
+struct omp_task_ext {
+    //children that have not finished yet in the low half, the ones among
+    // them that were created inside a taskgroup in the high half. Creating
+    // or finishing a child is a single atomic operation.
+    atomic<std::uint64_t> pending_children{0};
+
+    static std::uint64_t child_weight(bool in_taskgroup)
+    {
+        return in_taskgroup ? (std::uint64_t(1) << 32) + 1 : 1;
+    }
+    void child_created(bool in_taskgroup, std::uint64_t count = 1)
+    {
+        pending_children.fetch_add(count * child_weight(in_taskgroup), std::memory_order_relaxed);
+    }
+    void child_completed(bool in_taskgroup)
+    {
+        std::uint64_t weight = child_weight(in_taskgroup);
+        std::uint64_t left = pending_children.fetch_sub(weight) - weight;
+        //a waiter registers before its last look at the count, so either it
+        // sees this completion or the completion sees the waiter
+        if(waiters.load() != 0 &&
+           ((left & 0xffffffff) == 0 || (in_taskgroup && (left >> 32) == 0))) {
+            std::lock_guard<mutex_type> l(wait_mtx);
+            wait_cond.notify_all();
+        }
+    }
+    void wait_children();
+    void wait_taskgroup();
+
+    //threads suspended in wait_children or wait_taskgroup
+    atomic<int> waiters{0};
+    mutex_type wait_mtx;
+    hpx::lcos::local::condition_variable_any wait_cond;
+
+    //the most recently deferred children. Only the owning task pushes, a
+    // thread waiting in taskwait or a barrier takes them out and runs the
+    // ones no hpx thread has started yet.
+    static const unsigned ring_size = 16;
+    atomic<kmp_task_t*> ring[ring_size];
+    unsigned ring_head{0};
+
+    omp_task_ext();
+    ~omp_task_ext();
+    void push_child(kmp_task_t *task);
+    void clear_ring();
+
+#ifdef OMP_COMPLIANT
+    shared_ptr<local_priority_queue_executor> tg_exec;
+#endif
+    depends_map df_map;
+#if HPXMP_HAVE_OMP_50_ENABLED
+    intrusive_ptr<kmp_taskgroup_t> td_taskgroup;
+    //private reduction copies this task holds, given back when it ends
+    struct held_reduction_copy {
+        intrusive_ptr<kmp_taskgroup_t> taskgroup;
+        int item;
+        int copy; //-1 for an extra copy
+        void *priv;
+    };
+    vector<held_reduction_copy> reduction_copies;
+#endif
+    //the taskgraph region this task is recording
+    task_graph *recording{nullptr};
+    //deepest dependence chain among the children, see OMP_HPX_CRITICAL_PATH
+    std::uint32_t max_depth{0};
+
+    static void* operator new(std::size_t size)
+    {
+        return task_allocator::get_instance().allocate(size);
+    }
+    static void operator delete(void *p)
+    {
+        task_allocator::get_instance().deallocate(p);
+    }
+};
+
 //What parts of a task could I move to a shared state to get a performance
 // improvement, or some other, orgizational improvement?
 // icvs?
@@ -253,7 +665,7 @@ class omp_task_data {
     public:
         //This constructor should only be used once for the implicit task
         omp_task_data( parallel_region *T, omp_device_icv *global, int init_num_threads)
-            : team(T),taskLatch(0)
+            : team(T)
         {
             local_thread_num = 0;
             icv.device = global;
@@ -273,12 +685,56 @@ class omp_task_data {
 
         //This is for explicit tasks
         omp_task_data(int tid, parallel_region *T, omp_icv icv_vars)
-            : local_thread_num(tid), team(T), taskLatch(0), icv(icv_vars)
+            : local_thread_num(tid), team(T), icv(icv_vars)
         {
             threads_requested = icv.nthreads;
             icv_vars.device = icv.device;
         };
 
+        //one is created for every explicit task, see task_allocator
+        static void* operator new(std::size_t size)
+        {
+            return task_allocator::get_instance().allocate(size);
+        }
+        static void operator delete(void *p)
+        {
+            task_allocator::get_instance().deallocate(p);
+        }
+
+        //reinitializes the implicit task data of a cached region,
+        // pointer_counter is left alone
+        void reset_implicit(int tid, parallel_region *T, omp_task_data *P)
+        {
+            local_thread_num = tid;
+            team = T;
+            icv = P->icv;
+            threads_requested = icv.nthreads;
+            icv.levels++;
+            if(team->num_threads > 1) {
+                icv.active_levels++;
+            }
+            single_counter = 0;
+            loop_num = 0;
+            in_taskgroup = false;
+            final_task = false;
+            //all children are done, pending_children is zero
+            if(ext) {
+                ext->clear_ring();
+#ifdef OMP_COMPLIANT
+                ext->tg_exec.reset();
+#endif
+                ext->df_map.clear();
+#if HPXMP_HAVE_OMP_50_ENABLED
+                ext->td_taskgroup.reset();
+#endif
+                ext->recording = nullptr;
+                ext->max_depth = 0;
+            }
+#if HPXMP_HAVE_OMPT
+            task_data = ompt_data_none;
+#endif
+        }
+
         //assuming the number of threads that can be created is infinte (so I can avoid using ThreadsBusy)
         //See section 2.3 of the OpenMP 4.0 spec for details on ICVs.
         void set_threads_requested( int nthreads ){
@@ -294,6 +750,15 @@ class omp_task_data {
             }
         }
 
+        //only to be called by the thread running this task
+        omp_task_ext& get_ext()
+        {
+            if(!ext) {
+                ext.reset(new omp_task_ext);
+            }
+            return *ext;
+        }
+
         int local_thread_num;
         //int global_thread_num;
         int threads_requested;
@@ -303,24 +768,17 @@ class omp_task_data {
         int single_counter{0};
         int loop_num{0};
         bool in_taskgroup{false};
-        hpxmp_latch taskLatch;
+        //inside a final task, every new task is included
+        bool final_task{false};
         atomic<int> pointer_counter{0};
         //shared_future<void> last_df_task;
 #if HPXMP_HAVE_OMPT
         ompt_data_t task_data = ompt_data_none;
 #endif
 
-#ifdef OMP_COMPLIANT
-        shared_ptr<local_priority_queue_executor> tg_exec;
-#else
-        shared_ptr<hpxmp_latch> taskgroupLatch;
-#endif
 
         omp_icv icv;
-        depends_map df_map;
-#if HPXMP_HAVE_OMP_50_ENABLED
-        intrusive_ptr<kmp_taskgroup_t> td_taskgroup;
-#endif
+        std::unique_ptr<omp_task_ext> ext;
 };
 
 inline void intrusive_ptr_add_ref(omp_task_data *x)
@@ -334,9 +792,181 @@ inline void intrusive_ptr_release(omp_task_data *x)
         delete x;
 }
 
-struct raw_data {
-    void *data;
+omp_task_data* exchange_current_task(omp_task_data *data);
+void execute_task_inline(int gtid, kmp_task_t *kmp_task, omp_task_data *parent);
+bool run_pending_children(int gtid, omp_task_data *parent, bool owner);
+void wait_team_tasks(int gtid, parallel_region *team);
+
+// One version of a futurized variable, see __kmpc_future_cached. Every task
+// that writes the variable produces a new buffer, a buffer is freed once
+// neither its future nor a task reading it holds it any more.
+struct alignas(16) raw_buffer {
+    atomic<int> pointer_counter{0};
     size_t size;
+
+    void* data() { return this + 1; }
+    static raw_buffer* create(size_t size)
+    {
+        void *p = task_allocator::get_instance().allocate(sizeof(raw_buffer) + size);
+        raw_buffer *buffer = new (p) raw_buffer;
+        buffer->size = size;
+        return buffer;
+    }
+};
+
+inline void intrusive_ptr_add_ref(raw_buffer *x)
+{
+    ++x->pointer_counter;
+}
+
+inline void intrusive_ptr_release(raw_buffer *x)
+{
+    if (--x->pointer_counter == 0) {
+        x->~raw_buffer();
+        task_allocator::get_instance().deallocate(x);
+    }
+}
+
+typedef intrusive_ptr<raw_buffer> raw_data;
+
+// Argument array of a fork call. Short argument lists are kept inline so
+// that a fork does not allocate.
+class fork_args {
+    public:
+        explicit fork_args(int argc)
+            : args(argc <= inline_args ? inline_buffer : new void*[argc])
+        {}
+        ~fork_args()
+        {
+            if(args != inline_buffer) {
+                delete[] args;
+            }
+        }
+
+        fork_args(fork_args const&) = delete;
+        fork_args& operator=(fork_args const&) = delete;
+
+        void*& operator[](int i) { return args[i]; }
+        void** data() { return args; }
+
+    private:
+        static const int inline_args = 16;
+        void *inline_buffer[inline_args];
+        void **args;
+};
+
+// Lets parked hpx threads wait for the next job. A waiting thread spins
+// (yielding) for spin_time microseconds and then suspends until post
+// publishes a new job. Every job carries the number of threads it needs.
+class park_signal {
+    public:
+        explicit park_signal(std::int64_t spin_time) : spin_time(spin_time) {}
+
+        //the last job, the generation in the high half, its thread count in
+        // the low half
+        std::uint64_t current() const { return job.load(std::memory_order_acquire); }
+        static int job_threads(std::uint64_t job) { return static_cast<int>(job & 0xffffffff); }
+
+        //returns once the job is no longer seen, false if stopped
+        bool wait(std::uint64_t seen);
+        void post(int num_threads);
+        void stop();
+
+    private:
+        const std::int64_t spin_time;
+        atomic<std::uint64_t> job{0};
+        atomic<int> sleepers{0};
+        atomic<bool> stopped{false};
+        mutex_type mtx;
+        hpx::lcos::local::condition_variable_any cond;
+};
+
+// A hot team is a set of implicit-task workers that outlive the parallel
+// region which created them. Between regions the workers park on signal
+// until the next fork of the same depth publishes a new job. A team also runs
+// regions smaller than itself, its extra workers go back to waiting.
+class hot_team {
+    public:
+        hot_team(int num_threads, int depth, std::int64_t spin_time, int fanout);
+        ~hot_team();
+
+        hot_team(hot_team const&) = delete;
+        hot_team& operator=(hot_team const&) = delete;
+
+        // a hot team runs one region at a time, a concurrent fork of the
+        // same depth falls back to spawning fresh threads
+        bool try_acquire() { return !busy.exchange(true, std::memory_order_acquire); }
+        void release()
+        {
+            //the parent may be reused implicit task data, see
+            // parallel_region::implicit_task_data
+            job.parent.reset();
+            busy.store(false, std::memory_order_release);
+        }
+
+        // hand the region to the workers, threadLatch is counted down by
+        // every worker once it has finished its implicit task
+        void run( invoke_func kmp_invoke, microtask_t thread_func,
+                  int argc, void **argv, parallel_region *team,
+                  intrusive_ptr<omp_task_data> parent, hpxmp_latch &threadLatch );
+
+        const int num_threads;
+        const int depth;
+
+    private:
+        struct job_data {
+            invoke_func kmp_invoke;
+            microtask_t thread_func;
+            int argc;
+            void **argv;
+            parallel_region *team;
+            intrusive_ptr<omp_task_data> parent;
+            hpxmp_latch *threadLatch;
+        };
+
+        void worker_loop(int tid);
+        void stop_workers();
+
+        job_data job;
+        park_signal signal;
+        atomic<bool> busy{false};
+        hpxmp_latch exitLatch;
+};
+
+// Runs the forks of threads that are not hpx threads on a parked hpx thread,
+// so that such a fork does not create an hpx thread every time. It takes one
+// fork at a time, a concurrent one uses run_as_hpx_thread.
+class fork_handoff {
+    public:
+        explicit fork_handoff(std::int64_t spin_time);
+        //must run on an hpx thread
+        ~fork_handoff();
+
+        fork_handoff(fork_handoff const&) = delete;
+        fork_handoff& operator=(fork_handoff const&) = delete;
+
+        bool try_acquire() { return !busy.exchange(true, std::memory_order_acquire); }
+
+        //forks the region on the parked thread and returns once it has
+        // joined, the handoff is released again
+        void run( invoke_func kmp_invoke, microtask_t thread_func,
+                  int argc, void **argv, intrusive_ptr<omp_task_data> parent );
+
+    private:
+        void worker_loop();
+
+        invoke_func kmp_invoke;
+        microtask_t thread_func;
+        int argc;
+        void **argv;
+        intrusive_ptr<omp_task_data> parent;
+        park_signal signal;
+        atomic<bool> busy{false};
+        //the caller is not an hpx thread, it waits on a std condition variable
+        std::mutex done_mtx;
+        std::condition_variable done_cond;
+        bool done{false};
+        hpxmp_latch exitLatch;
 };
 
 class hpx_runtime {
@@ -345,6 +975,7 @@ class hpx_runtime {
         void fork(invoke_func kmp_invoke, microtask_t thread_func, int argc, void** argv);
         parallel_region* get_team();
         bool set_thread_data_check();
+        omp_task_data* current_task();
         intrusive_ptr<omp_task_data> get_task_data();
         int get_thread_num();
         int get_num_threads();
@@ -357,7 +988,10 @@ class hpx_runtime {
         void create_df_task( int gtid, kmp_task_t *thunk,
                              int ndeps, kmp_depend_info_t *dep_list,
                              int ndeps_noalias, kmp_depend_info_t *noalias_dep_list );
-        ~hpx_runtime()=default;
+        void taskloop( int gtid, kmp_task_t *task, int if_val,
+                       std::uint64_t *lb, std::uint64_t *ub, std::int64_t st,
+                       int nogroup, int sched, std::uint64_t grainsize, void *task_dup );
+        ~hpx_runtime();
 
 #ifdef FUTURIZE_TASKS
         void create_future_task( int gtid, kmp_task_t *thunk,
@@ -365,6 +999,8 @@ class hpx_runtime {
 #endif
         void task_exit();
         void task_wait();
+        void wait_deps( int gtid, int ndeps, kmp_depend_info_t *dep_list,
+                        int ndeps_noalias, kmp_depend_info_t *noalias_dep_list );
         double get_time();
         void delete_hpx_objects();
         void env_init();
@@ -372,9 +1008,20 @@ class hpx_runtime {
         void** get_threadprivate();
         bool start_taskgroup();
         void end_taskgroup();
+        bool start_record_task( int gtid, int graph_id, bool nowait, bool re_record );
+        void end_record_task( int gtid, int graph_id, bool nowait );
+        parallel_region* acquire_region(parallel_region *parent, int num_threads);
+        void release_region(parallel_region *region);
+        void serialized_parallel_begin();
+        void serialized_parallel_end();
+        hot_team* acquire_hot_team(int depth, int num_threads);
+        void release_hot_team(hot_team *team);
+        fork_handoff* acquire_fork_handoff();
+        int spawn_fanout(int num_threads) const;
 #if HPXMP_HAVE_POOL
         thread_pool TPool;
 #endif
+        task_throttle throttle;
 
     private:
         shared_ptr<parallel_region> implicit_region;
@@ -383,6 +1030,45 @@ class hpx_runtime {
         shared_ptr<high_resolution_timer> walltime;
         bool external_hpx;
         omp_device_icv device_icv;
+        //a few reusable parallel regions per nesting depth, so that forks
+        // of alternating team sizes all find theirs
+        struct region_slot {
+            shared_ptr<parallel_region> region;
+            atomic<bool> busy{false};
+        };
+        static const int max_cached_depth = 8;
+        static const int regions_per_depth = 4;
+        region_slot region_cache[max_cached_depth][regions_per_depth];
+        //hot teams, indexed by nesting depth - 1
+        vector<shared_ptr<hot_team>> hot_teams;
+        mutex_type hot_team_mtx;
+        //created by the first fork of a thread that is not an hpx thread
+        shared_ptr<fork_handoff> external_fork;
+        //teams of one for serialized regions, a list per worker and one for
+        // the threads that are not hpx threads. They never take a slot of the
+        // region cache, which is shared by all threads of a depth.
+        struct alignas(64) serialized_teams {
+            mutex_type mtx;
+            vector<std::unique_ptr<parallel_region>> teams;
+        };
+        static const std::size_t max_serialized_teams = 8;
+        aligned_array<serialized_teams> serialized_cache;
+        std::size_t num_serialized_caches{0};
+        serialized_teams& local_serialized_teams();
+        bool use_hot_teams{true};
+        int hot_teams_max_level{1};
+        std::int64_t spin_time{200};
+        int tree_fork_threshold{64};
+        int tree_fork_fanout{8};
+        bool task_alloc_stats{false};
+        bool use_task_throttle{true};
+        std::int64_t task_inflight_limit{256};
+        bool critical_path_priority{false};
+        //recorded taskgraph regions by id, never removed
+        std::unordered_map<int, std::unique_ptr<task_graph>> task_graphs;
+        //replaced by re_record, replays may still use them
+        vector<std::unique_ptr<task_graph>> retired_task_graphs;
+        mutex_type task_graph_mtx;
         //atomic<int> threads_running{0};//ThreadsBusy
 };
 
@@ -8,6 +8,7 @@ struct omp_device_icv {
     //wait_policy //active
     int max_active_levels{std::numeric_limits<int>::max()};
     bool cancel{false};
+    int max_task_priority{0};
     //int stacksize_var; //-Ihpx.stacks.small_size=... (use hex numbers)
         //http://stellar-group.github.io/hpx/docs/html/hpx/manual/init/configuration/config_defaults.html
 };
@@ -18,7 +19,8 @@ struct omp_icv {
     bool dyn{false};
     bool nest{false};
     int nthreads;
-    //int run_sched{0};//static schedule
+    int run_sched{1};//static schedule, an omp_sched_t
+    int run_sched_chunk{0};//0 for the default chunk
     //bool bind{false};
     //int thread_limit{std::numeric_limits<int>::max()};
     int active_levels{0};
@@ -3,32 +3,32 @@
 #include <boost/shared_ptr.hpp>
 #include <iostream>
 #include <assert.h>
+#include <algorithm>
+#include <cstdlib>
+#include <new>
 
 using std::cout;
 using std::endl;
 
-boost::shared_ptr<hpx_runtime> hpx_backend;
+hpx_runtime *hpx_backend = nullptr;
 
+static std::mutex backend_mtx;
 
-//This is called where the library calls can potentially be executed
-// outside a parallel region. If the function is not able to be called from
-// outside a parallel region, it makes this check and generates it's own 
-// output, but does not start the runtime.
-void start_backend(){
+//Slow path of start_backend, entry points may be called from several os
+// threads at once before any parallel region exists.
+void init_backend(){
     #if defined DEBUG && defined HPXMP_HAVE_TRACE
-        std::cout<<"start_backend"<<std::endl;
+        std::cout<<"init_backend"<<std::endl;
     #endif
+    std::lock_guard<std::mutex> lk(backend_mtx);
     if(!hpx_backend) {
-        hpx_backend.reset(new hpx_runtime());
+        hpx_runtime *runtime = new hpx_runtime();
+        //start_backend reads hpx_backend without the lock
+        __atomic_store_n(&hpx_backend, runtime, __ATOMIC_RELEASE);
         #if defined DEBUG && defined HPXMP_HAVE_TRACE
                 std::cout<<"new hpx runtime started"<<std::endl;
         #endif
     }
-    else {
-        #if defined DEBUG && defined HPXMP_HAVE_TRACE
-                std::cout << "hpx runtime exists" << std::endl;
-        #endif
-    }
 }
 
 int __kmpc_ok_to_fork(ident_t *loc){
@@ -63,8 +63,7 @@ __kmpc_fork_call(ident_t *loc, kmp_int32 argc, kmpc_micro microtask, ...) {
     ompt_post_init();
 #endif
     start_backend();
-    vector<void*> argv(argc);
-    start_backend();
+    fork_args argv(argc);
 
     va_list     ap;
     va_start(   ap, microtask );
@@ -89,16 +88,19 @@ __kmpc_omp_task_alloc( ident_t *loc_ref, kmp_int32 gtid, kmp_int32 flags,
         std::cout<<"__kmpc_omp_task_alloc"<<std::endl;
     #endif
     start_backend();
-    //kmp_tasking_flags_t *input_flags = (kmp_tasking_flags_t *) & flags;
-    //TODO: do I need to do something with these flags?
+    kmp_tasking_flags_t *input_flags = (kmp_tasking_flags_t *) & flags;
     int task_size = sizeof_kmp_task_t + (-sizeof_kmp_task_t%8);
     //can be sure that no deletion of task happens here, no need of intrusive ptr
-    kmp_task_t *task = (kmp_task_t*)new char[task_size + sizeof_shareds]; 
+    kmp_task_t *task = allocate_task(task_size + sizeof_shareds);
 
-    //This gets deleted at the end of task_setup
+    //This gets freed once the last intrusive_ptr to it is gone, or in
+    // __kmpc_omp_task_complete_if0 for undeferred tasks
     task->routine = task_entry;
-    task->gcc = false;
-    task->pointer_counter = 0;
+    kmp_task_header_t *header = task_header(task);
+    header->final = input_flags->final;
+    header->untied = !input_flags->tiedness;
+    //the compiler stores the value in data2 after this returns
+    header->has_priority = input_flags->priority_specified;
     if( sizeof_shareds == 0 ) {
         task->shareds = NULL;
     } else {
@@ -206,49 +208,206 @@ kmp_int32 __kmpc_omp_taskyield(ident_t *loc_ref, kmp_int32 gtid, int end_part ){
 
 #if HPXMP_HAVE_OMP_50_ENABLED
 // Task Reduction implementation
+//
+// Every item gets one private copy per hpx worker. A task takes a copy the
+// first time it asks for the item and holds it until it ends, copies are not
+// tied to workers: an hpx thread that suspends may resume on another worker,
+// the copy goes along with it. A task starts looking at the copy of the
+// worker it runs on and takes the first free one with an atomic exchange.
+// When all are held, by tasks that suspended, it gets an extra copy. Copies
+// start on a cache line of their own.
+
+// items above this size, times the number of copies, are combined as a tree
+static const std::size_t parallel_combine_size = 64 * 1024;
+
+static void *alloc_reduction_block(std::size_t size) {
+    void *p = NULL;
+    if (posix_memalign(&p, 64, size) != 0)
+        throw std::bad_alloc();
+    return p;
+}
+
+static std::size_t reduction_slot(kmp_taskgroup_t *tg, void *shared) {
+    std::uint64_t h = reinterpret_cast<std::uintptr_t>(shared) * 0x9E3779B97F4A7C15ull;
+    return (h ^ (h >> 32)) & (tg->reduce_index.size() - 1);
+}
+
 void *__kmpc_task_reduction_init(int gtid, int num, void *data) {
     auto thread = hpx_backend->get_task_data();
-    intrusive_ptr<kmp_taskgroup_t> tg = thread->td_taskgroup;
+    intrusive_ptr<kmp_taskgroup_t> tg = thread->get_ext().td_taskgroup;
     int nth = thread->team->num_threads;
     kmp_task_red_input_t *input = (kmp_task_red_input_t *)data;
 
     if (nth == 1) {
         return (void *)tg.get();
     }
-    shared_ptr<vector<kmp_task_red_data_t>> arr(new(vector<kmp_task_red_data_t>));
-    arr->reserve(num);
+    std::size_t copies = hpx::get_os_thread_count();
+    tg->reduce_data.resize(num);
+    std::size_t index_size = 4;
+    while (index_size < 2 * static_cast<std::size_t>(num))
+        index_size *= 2;
+    tg->reduce_index.assign(index_size, -1);
     for (int i = 0; i < num; ++i) {
+        kmp_task_red_data_t &item = tg->reduce_data[i];
         void (*f_init)(void *) = (void (*)(void *))(input[i].reduce_init);
-        size_t size = input[i].reduce_size - 1;
-        // round the size up to cache line per thread-specific item
-        size += 64 - size % 64;
-        (*arr)[i].reduce_shar = input[i].reduce_shar;
-        (*arr)[i].reduce_size = size;
-        (*arr)[i].reduce_init = input[i].reduce_init;
-        (*arr)[i].reduce_fini = input[i].reduce_fini;
-        (*arr)[i].reduce_comb = input[i].reduce_comb;
-        (*arr)[i].flags = input[i].flags;
+        // round the size up to cache line per worker-specific item
+        size_t size = (input[i].reduce_size + 63) / 64 * 64;
+        item.reduce_shar = input[i].reduce_shar;
+        item.reduce_size = size;
+        item.reduce_init = input[i].reduce_init;
+        item.reduce_fini = input[i].reduce_fini;
+        item.reduce_comb = input[i].reduce_comb;
+        item.flags = input[i].flags;
+        item.reduce_busy = new std::atomic<bool>[copies];
+        for (std::size_t j = 0; j < copies; ++j)
+            item.reduce_busy[j].store(false, std::memory_order_relaxed);
         if (!input[i].flags.lazy_priv) {
-            // allocate cache-line aligned block and fill it with zeros
-            (*arr)[i].reduce_priv = new char[nth * size];
-            (*arr)[i].reduce_pend = (char *)((*arr)[i].reduce_priv) + nth * size;
+            // allocate cache-line aligned block and initialize the copies
+            item.reduce_priv = alloc_reduction_block(copies * size);
+            item.reduce_pend = (char *)(item.reduce_priv) + copies * size;
             if (f_init != NULL) {
-                // initialize thread-specific items
-                for (int j = 0; j < nth; ++j) {
-                    f_init((char *)((*arr)[i].reduce_priv) + j * size);
+                for (std::size_t j = 0; j < copies; ++j) {
+                    f_init((char *)(item.reduce_priv) + j * size);
                 }
             }
         } else {
-            // only allocate space for pointers now,
-            // objects will be lazily allocated/initialized once requested
-            (*arr)[i].reduce_priv = new char[nth * sizeof(void *)];
+            // only allocate space for pointers now, the first task to hold
+            // a copy allocates and initializes it
+            void **p_priv = new void *[copies];
+            std::fill(p_priv, p_priv + copies, (void *)NULL);
+            item.reduce_priv = p_priv;
+            item.reduce_pend = NULL;
         }
+        std::size_t slot = reduction_slot(tg.get(), item.reduce_shar);
+        while (tg->reduce_index[slot] != -1)
+            slot = (slot + 1) & (index_size - 1);
+        tg->reduce_index[slot] = i;
     }
-    tg->reduce_data = arr;
     tg->reduce_num_data = num;
+    tg->reduce_nth = copies;
     return (void *)tg.get();
 }
 
+// The item data belongs to, looked up by its shared address. A private copy
+// handed in by a nested task is found by searching the copies.
+static kmp_task_red_data_t *find_reduction_item(kmp_taskgroup_t *tg, void *data) {
+    if (tg->reduce_num_data == 0)
+        return NULL;
+    for (std::size_t slot = reduction_slot(tg, data); tg->reduce_index[slot] != -1;
+         slot = (slot + 1) & (tg->reduce_index.size() - 1)) {
+        kmp_task_red_data_t &item = tg->reduce_data[tg->reduce_index[slot]];
+        if (item.reduce_shar == data)
+            return &item;
+    }
+    for (auto &item : tg->reduce_data) {
+        if (!item.flags.lazy_priv) {
+            if (data >= item.reduce_priv && data < item.reduce_pend)
+                return &item;
+        } else {
+            void **p_priv = (void **)(item.reduce_priv);
+            for (std::size_t j = 0; j < tg->reduce_nth; ++j)
+                if (data == p_priv[j])
+                    return &item;
+        }
+    }
+    std::lock_guard<mutex_type> l(tg->reduce_extra_mtx);
+    for (auto const &extra : tg->reduce_extra) {
+        if (data == extra.second)
+            return &tg->reduce_data[extra.first];
+    }
+    return NULL;
+}
+
+/*!
+@ingroup TASKING
+@param gtid    Global thread ID
+@param tskgrp  The taskgroup ID (optional)
+@param data    Shared location of the item
+@return The pointer to per-thread data
+
+Get thread-specific location of data item
+*/
+// A new private copy of item, initialized.
+static void *new_reduction_copy(kmp_task_red_data_t const &item) {
+    void (*f_init)(void *) = (void (*)(void *))(item.reduce_init);
+    void *priv = alloc_reduction_block(item.reduce_size);
+    if (f_init != NULL)
+        f_init(priv);
+    return priv;
+}
+
+// Takes a copy of item index for the calling task, see above.
+static void *hold_reduction_copy(omp_task_ext &ext, kmp_taskgroup_t *tg, int index) {
+    for (auto const &held : ext.reduction_copies) {
+        if (held.taskgroup.get() == tg && held.item == index)
+            return held.priv;
+    }
+    kmp_task_red_data_t &item = tg->reduce_data[index];
+    std::size_t copies = tg->reduce_nth;
+    std::size_t worker = hpx::get_worker_thread_num();
+    for (std::size_t i = 0; i < copies; ++i) {
+        std::size_t j = (worker + i) % copies;
+        if (item.reduce_busy[j].load(std::memory_order_relaxed) ||
+            item.reduce_busy[j].exchange(true, std::memory_order_acquire))
+            continue;
+        void *priv;
+        if (!item.flags.lazy_priv) {
+            priv = (char *)(item.reduce_priv) + j * item.reduce_size;
+        } else {
+            // the holder of a copy is the only one to touch its slot
+            void **p_priv = (void **)(item.reduce_priv);
+            if (p_priv[j] == NULL)
+                p_priv[j] = new_reduction_copy(item);
+            priv = p_priv[j];
+        }
+        ext.reduction_copies.push_back({tg, index, static_cast<int>(j), priv});
+        return priv;
+    }
+
+    void *priv = NULL;
+    {
+        std::lock_guard<mutex_type> l(tg->reduce_extra_mtx);
+        for (auto it = tg->reduce_extra_free.begin(); it != tg->reduce_extra_free.end(); ++it) {
+            if (it->first == index) {
+                priv = it->second;
+                tg->reduce_extra_free.erase(it);
+                break;
+            }
+        }
+    }
+    if (priv == NULL) {
+        priv = new_reduction_copy(item);
+        std::lock_guard<mutex_type> l(tg->reduce_extra_mtx);
+        tg->reduce_extra.emplace_back(index, priv);
+    }
+    ext.reduction_copies.push_back({tg, index, -1, priv});
+    return priv;
+}
+
+void release_reduction_copies(omp_task_data *task, kmp_taskgroup_t *tg) {
+    if (!task->ext || task->ext->reduction_copies.empty())
+        return;
+    auto &held_copies = task->ext->reduction_copies;
+    auto keep = held_copies.begin();
+    for (auto &held : held_copies) {
+        if (tg != NULL && held.taskgroup.get() != tg) {
+            if (&*keep != &held)
+                *keep = std::move(held);
+            ++keep;
+            continue;
+        }
+        kmp_taskgroup_t *group = held.taskgroup.get();
+        if (held.copy >= 0) {
+            group->reduce_data[held.item].reduce_busy[held.copy].store(
+                false, std::memory_order_release);
+        } else {
+            std::lock_guard<mutex_type> l(group->reduce_extra_mtx);
+            group->reduce_extra_free.emplace_back(held.item, held.priv);
+        }
+    }
+    held_copies.erase(keep, held_copies.end());
+}
+
 /*!
 @ingroup TASKING
 @param gtid    Global thread ID
@@ -264,82 +423,88 @@ void *__kmpc_task_reduction_get_th_data(int gtid, void *tskgrp, void *data) {
     if (nth == 1)
         return data; // nothing to do
 
-    intrusive_ptr<kmp_taskgroup_t> tg = (kmp_taskgroup_t*)tskgrp;
+    kmp_taskgroup_t *tg = (kmp_taskgroup_t*)tskgrp;
     if (tg == NULL)
-        tg = thread->td_taskgroup;
-    shared_ptr<vector<kmp_task_red_data_t>> arr = tg->reduce_data;
-    kmp_int32 num = tg->reduce_num_data;
-    kmp_int32 tid = gtid;
-
-    while (tg != NULL) {
-        for (int i = 0; i < num; ++i) {
-            if (!(*arr)[i].flags.lazy_priv) {
-                if (data == (*arr)[i].reduce_shar ||
-                    (data >= (*arr)[i].reduce_priv && data < (*arr)[i].reduce_pend))
-                    return (char *)((*arr)[i].reduce_priv) + tid * (*arr)[i].reduce_size;
-            } else {
-                // check shared location first
-                void **p_priv = (void **)((*arr)[i].reduce_priv);
-                if (data == (*arr)[i].reduce_shar)
-                    goto found;
-                // check if we get some thread specific location as parameter
-                for (int j = 0; j < nth; ++j)
-                    if (data == p_priv[j])
-                        goto found;
-                continue; // not found, continue search
-                found:
-                if (p_priv[tid] == NULL) {
-                    // allocate thread specific object lazily
-                    void (*f_init)(void *) = (void (*)(void *))((*arr)[i].reduce_init);
-                    p_priv[tid] = new char[(*arr)[i].reduce_size];
-                    if (f_init != NULL) {
-                        f_init(p_priv[tid]);
-                    }
-                }
-                return p_priv[tid];
+        tg = thread->get_ext().td_taskgroup.get();
+
+    for (; tg != NULL; tg = tg->parent.get()) {
+        kmp_task_red_data_t *item = find_reduction_item(tg, data);
+        if (item == NULL)
+            continue;
+        return hold_reduction_copy(thread->get_ext(), tg,
+                                   static_cast<int>(item - tg->reduce_data.data()));
+    }
+    return NULL; // ERROR, this line never executed
+}
+
+// Combines the copies into the shared item. Large items are combined
+// pairwise in parallel, log2(copies) rounds, then once into the shared item.
+static void combine_reduction_copies(void *sh_data, vector<void *> const &copies,
+                                     void (*f_comb)(void *, void *), size_t size) {
+    if (copies.size() > 2 && size * copies.size() >= parallel_combine_size) {
+        for (std::size_t step = 1; step < copies.size(); step *= 2) {
+            vector<hpx::future<void>> round;
+            for (std::size_t j = 0; j + step < copies.size(); j += 2 * step) {
+                void *dst = copies[j];
+                void *src = copies[j + step];
+                round.push_back(hpx::async([f_comb, dst, src]() { f_comb(dst, src); }));
             }
+            hpx::wait_all(round);
+        }
+        f_comb(sh_data, copies[0]);
+    } else {
+        for (void *priv_data : copies) {
+            f_comb(sh_data, priv_data); // combine results
         }
-        tg = tg->parent;
-        arr = tg->reduce_data;
-        num = tg->reduce_num_data;
     }
-    return NULL; // ERROR, this line never executed
 }
 
 // Finalize task reduction.
 // Called from __kmpc_end_taskgroup()
 void __kmp_task_reduction_fini(void *thr, intrusive_ptr<kmp_taskgroup_t> tg) {
-    auto th = hpx_backend->get_task_data();
-    kmp_int32 nth = th->team->num_threads;
-    shared_ptr<vector<kmp_task_red_data_t>> arr = tg->reduce_data;
-    kmp_int32 num = tg->reduce_num_data;
-    for (int i = 0; i < num; ++i) {
-        void *sh_data = (*arr)[i].reduce_shar;
-        void (*f_fini)(void *) = (void (*)(void *))((*arr)[i].reduce_fini);
+    std::size_t nth = tg->reduce_nth;
+    vector<void *> copies;
+    copies.reserve(nth);
+    for (auto &item : tg->reduce_data) {
+        void *sh_data = item.reduce_shar;
+        void (*f_fini)(void *) = (void (*)(void *))(item.reduce_fini);
         void (*f_comb)(void *, void *) =
-        (void (*)(void *, void *))((*arr)[i].reduce_comb);
-        if (!(*arr)[i].flags.lazy_priv) {
-            void *pr_data = (*arr)[i].reduce_priv;
-            size_t size = (*arr)[i].reduce_size;
-            for (int j = 0; j < nth; ++j) {
-                void *priv_data = (char *)pr_data + j * size;
-                f_comb(sh_data, priv_data); // combine results
-                if (f_fini)
-                    f_fini(priv_data); // finalize if needed
+        (void (*)(void *, void *))(item.reduce_comb);
+        copies.clear();
+        if (!item.flags.lazy_priv) {
+            for (std::size_t j = 0; j < nth; ++j) {
+                copies.push_back((char *)(item.reduce_priv) + j * item.reduce_size);
             }
         } else {
-            void **pr_data = (void **)((*arr)[i].reduce_priv);
-            for (int j = 0; j < nth; ++j) {
-                if (pr_data[j] != NULL) {
-                    f_comb(sh_data, pr_data[j]); // combine results
-                    if (f_fini)
-                        f_fini(pr_data[j]); // finalize if needed
-                        delete(pr_data[j]);
-                }
+            void **p_priv = (void **)(item.reduce_priv);
+            for (std::size_t j = 0; j < nth; ++j) {
+                if (p_priv[j] != NULL)
+                    copies.push_back(p_priv[j]);
             }
         }
+        std::size_t regular = copies.size();
+        int index = static_cast<int>(&item - tg->reduce_data.data());
+        for (auto const &extra : tg->reduce_extra) {
+            if (extra.first == index)
+                copies.push_back(extra.second);
+        }
+        combine_reduction_copies(sh_data, copies, f_comb, item.reduce_size);
+        for (std::size_t j = 0; j < copies.size(); ++j) {
+            if (f_fini)
+                f_fini(copies[j]); // finalize if needed
+            if (item.flags.lazy_priv || j >= regular)
+                free(copies[j]);
+        }
+        if (!item.flags.lazy_priv)
+            free(item.reduce_priv);
+        else
+            delete[] (void **)(item.reduce_priv);
+        delete[] item.reduce_busy;
     }
-    tg->reduce_data = NULL;
+    tg->reduce_extra.clear();
+    tg->reduce_extra_free.clear();
+    tg->reduce_data.clear();
+    tg->reduce_index.clear();
     tg->reduce_num_data = 0;
 }
 #endif
@@ -405,12 +570,7 @@ __kmpc_omp_wait_deps( ident_t *loc_ref, kmp_int32 gtid, kmp_int32 ndeps,
         std::cout<<"__kmpc_omp_wait_deps"<<std::endl;
     #endif
     start_backend();
-    //Not handling dependencies at the moment
-    if(ndeps > 0 || ndeps_noalias > 0){
-        cout <<"task has more than 0 dependencies. This runtime does not support task dependencies\n";
-        assert(ndeps == 0);
-        assert(ndeps_noalias == 0);
-    }
+    hpx_backend->wait_deps(gtid, ndeps, dep_list, ndeps_noalias, noalias_dep_list);
 }
 
 void __kmpc_omp_task_begin_if0( ident_t *loc_ref, kmp_int32 gtid, kmp_task_t * task ){
@@ -418,9 +578,14 @@ void __kmpc_omp_task_begin_if0( ident_t *loc_ref, kmp_int32 gtid, kmp_task_t * t
         std::cout<<"__kmpc_omp_task_begin_if0"<<std::endl;
     #endif
     start_backend();
-    task->routine(gtid, task);
-    //FIXME: not sure if this is correct. These only seem to do internal 
-    //tracking in the intel runtime
+    //the compiler runs the task itself between the two calls, all that is
+    // left to do is giving it a task data of its own
+    omp_task_data *parent = hpx_backend->current_task();
+    taskgraph_not_replayable(parent);
+    omp_task_data *task_data = new omp_task_data(gtid, parent->team, parent->icv);
+    task_data->final_task = parent->final_task || task_header(task)->final;
+    intrusive_ptr_add_ref(task_data);
+    task_header(task)->encountering = exchange_current_task(task_data);
 }
 void
 __kmpc_omp_task_complete_if0( ident_t *loc_ref, kmp_int32 gtid, kmp_task_t *task) {
@@ -428,8 +593,47 @@ __kmpc_omp_task_complete_if0( ident_t *loc_ref, kmp_int32 gtid, kmp_task_t *task
         std::cout<<"__kmpc_omp_task_complete_if0"<<std::endl;
     #endif
     start_backend();
-    //This pairs up with task_begin_if0, waiting for the task that if0 starts.
-    //For now, I am just going to execute the thread in task begin, and do nothing here.
+    omp_task_data *task_data = exchange_current_task(task_header(task)->encountering);
+#if HPXMP_HAVE_OMP_50_ENABLED
+    release_reduction_copies(task_data);
+#endif
+    intrusive_ptr_release(task_data);
+    free_task(task);
+}
+
+// clang hands in the taskgroup itself and always passes nogroup = 1
+void
+__kmpc_taskloop( ident_t *loc, kmp_int32 gtid, kmp_task_t *task, kmp_int32 if_val,
+                 kmp_uint64 *lb, kmp_uint64 *ub, kmp_int64 st, kmp_int32 nogroup,
+                 kmp_int32 sched, kmp_uint64 grainsize, void *task_dup ) {
+    #if defined DEBUG && defined HPXMP_HAVE_TRACE
+        std::cout<<"__kmpc_taskloop"<<std::endl;
+    #endif
+    start_backend();
+    hpx_backend->taskloop(gtid, task, if_val, lb, ub, st, nogroup, sched, grainsize, task_dup);
+}
+
+// Taskgraph regions, the compiler only runs the region when this returns 1.
+// The first time a region runs its tasks are recorded, later on they are
+// replayed without running the region.
+kmp_int32
+__kmpc_start_record_task( ident_t *loc, kmp_int32 gtid, kmp_int32 input_flags, kmp_int32 tdg_id ) {
+    #if defined DEBUG && defined HPXMP_HAVE_TRACE
+        std::cout<<"__kmpc_start_record_task"<<std::endl;
+    #endif
+    start_backend();
+    kmp_taskgraph_flags_t *flags = (kmp_taskgraph_flags_t *) &input_flags;
+    return hpx_backend->start_record_task(gtid, tdg_id, flags->nowait, flags->re_record);
+}
+
+void
+__kmpc_end_record_task( ident_t *loc, kmp_int32 gtid, kmp_int32 input_flags, kmp_int32 tdg_id ) {
+    #if defined DEBUG && defined HPXMP_HAVE_TRACE
+        std::cout<<"__kmpc_end_record_task"<<std::endl;
+    #endif
+    start_backend();
+    kmp_taskgraph_flags_t *flags = (kmp_taskgraph_flags_t *) &input_flags;
+    hpx_backend->end_record_task(gtid, tdg_id, flags->nowait);
 }
 
 // ----- End Tasks -----
@@ -442,9 +646,7 @@ __kmpc_push_num_threads( ident_t *loc,
         std::cout<<"__kmpc_push_num_threads"<<std::endl;
     #endif
     start_backend();
-    start_backend();
-    auto data = hpx_backend->get_task_data();
-    data->set_threads_requested( num_threads );
+    hpx_backend->current_task()->set_threads_requested( num_threads );
 }
 
 void
@@ -514,8 +716,11 @@ int __kmpc_single(ident_t *loc, int tid){
     if(!hpx_backend || !hpx::threads::get_self_ptr() ) {
         return 1;
     }
-    auto task = hpx_backend->get_task_data();
+    omp_task_data *task = hpx_backend->current_task();
     auto *team = task->team;
+    if(team->num_threads == 1) {
+        return 1;
+    }
     int do_work = 0;
 
     team->single_mtx.lock();
@@ -562,6 +767,9 @@ __kmpc_critical( ident_t * loc, kmp_int32 global_tid, kmp_critical_name * crit )
     #endif
     start_backend();
     parallel_region *team = hpx_backend->get_team();
+    if(team->num_threads == 1) {
+        return;
+    }
     team->crit_mtx.lock();
 }
 
@@ -572,6 +780,9 @@ __kmpc_end_critical(ident_t *loc, kmp_int32 global_tid, kmp_critical_name *crit)
     #endif
     start_backend();
     parallel_region *team = hpx_backend->get_team();
+    if(team->num_threads == 1) {
+        return;
+    }
     team->crit_mtx.unlock();
 }
 
@@ -592,16 +803,18 @@ void * __kmpc_future_cached(ident_t *  loc, kmp_int32  global_tid, void *data, s
     void *retval;
     shared_future<raw_data> *future_ptr;
     if(!(*cache)) {
-        raw_data data; //TODO: When is this freed?
-        data.data = (void*)new char[size]{0};
-        data.size = size;
+        //the first version, zero initialized. Tasks writing the variable
+        // replace it, it is freed once the last task reading it is done
+        raw_data data(raw_buffer::create(size));
+        memset(data->data(), 0, size);
         future_ptr = new shared_future<raw_data>(hpx::make_ready_future(data));
         *cache = (void**) future_ptr;
     } else {
         future_ptr = (shared_future<raw_data>*) *cache;
     }
 
-    retval = future_ptr->get().data;
+    //the latest version, valid until a task writes the variable again
+    retval = future_ptr->get()->data();
     return retval;
 }
 
@@ -639,7 +852,12 @@ __kmpc_copyprivate( ident_t *loc, kmp_int32 gtid, size_t cpy_size, void *cpy_dat
         std::cout<<"__kmpc_copyprivate"<<std::endl;
     #endif
     start_backend();
-    void **data_ptr = &(hpx_backend->get_team()->copyprivate_data);
+    parallel_region *team = hpx_backend->get_team();
+    //the single thread is the only one that needs the data
+    if(team->num_threads == 1) {
+        return;
+    }
+    void **data_ptr = &(team->copyprivate_data);
     if(didit) {
         *data_ptr = cpy_data;
     }
@@ -686,6 +904,10 @@ __kmpc_reduce( ident_t *loc, kmp_int32 gtid, kmp_int32 num_vars, size_t size,
         std::cout<<"__kmpc_reduce"<<std::endl;
     #endif
     start_backend();
+    //the only thread combines its own data, no barrier needed
+    if(hpx_backend->get_team()->num_threads == 1) {
+        return 1;
+    }
     bool atomic_avail = (loc->flags & 0x10) == 0x10;
     if( atomic_avail ) {
         hpx_backend->barrier_wait();
@@ -719,6 +941,9 @@ __kmpc_end_reduce( ident_t *loc, kmp_int32 gtid, kmp_critical_name *lck ) {
         std::cout<<"__kmpc_end_reduce"<<std::endl;
     #endif
     start_backend();
+    if(hpx_backend->get_team()->num_threads == 1) {
+        return;
+    }
     //note only master calls this if not using atomics
     bool atomic_avail = (loc->flags & 0x10) == 0x10;
     if( atomic_avail ) {
@@ -814,8 +1039,9 @@ void __kmpc_serialized_parallel( ident_t *, kmp_int32 global_tid ){
         std::cout<<"__kmpc_serialized_parallel"<<std::endl;
     #endif
     start_backend();
-    //Not sure if this needs to do anything. It is not used in clang, 
-    //only in icc generated code
+    //the outlined region is called by the compiler right after this, on
+    // the encountering thread, as a team of one
+    hpx_backend->serialized_parallel_begin();
 }
 
 void __kmpc_end_serialized_parallel ( ident_t *, kmp_int32 global_tid ) {
@@ -823,6 +1049,7 @@ void __kmpc_end_serialized_parallel ( ident_t *, kmp_int32 global_tid ) {
         std::cout<<"__kmpc_end_serialized_parallel"<<std::endl;
     #endif
     start_backend();
+    hpx_backend->serialized_parallel_end();
 }
 
 
@@ -860,7 +1087,7 @@ int omp_get_max_threads() {
         std::cout<<"omp_get_max_threads"<<std::endl;
     #endif
     start_backend();
-    return hpx_backend->get_task_data()->icv.nthreads;
+    return hpx_backend->current_task()->icv.nthreads;
 }
 
 int omp_get_num_procs(){
@@ -876,7 +1103,7 @@ void omp_set_num_threads(int num_threads) {
         std::cout<<"omp_set_num_threads"<<std::endl;
     #endif
     start_backend();
-    hpx_backend->get_task_data()->set_threads_requested(num_threads);
+    hpx_backend->current_task()->set_threads_requested(num_threads);
 }
 
 double omp_get_wtime(){
@@ -895,12 +1122,28 @@ double omp_get_wtick(){
     return .000000001;
 }
 
+int omp_in_final(){
+    #if defined DEBUG && defined HPXMP_HAVE_TRACE
+        std::cout<<"omp_in_final"<<std::endl;
+    #endif
+    start_backend();
+    return hpx_backend->current_task()->final_task;
+}
+
+int omp_get_max_task_priority(){
+    #if defined DEBUG && defined HPXMP_HAVE_TRACE
+        std::cout<<"omp_get_max_task_priority"<<std::endl;
+    #endif
+    start_backend();
+    return hpx_backend->current_task()->icv.device->max_task_priority;
+}
+
 int omp_in_parallel(){
     #if defined DEBUG && defined HPXMP_HAVE_TRACE
         std::cout<<"omp_in_parallel"<<std::endl;
     #endif
     start_backend();
-    int active_levels = hpx_backend->get_task_data()->icv.active_levels;
+    int active_levels = hpx_backend->current_task()->icv.active_levels;
     return (active_levels > 0);
 }
 
@@ -921,6 +1164,38 @@ int omp_get_dynamic(){
     return hpx_backend->get_task_data()->icv.dyn;
 }
 
+//a chunk size below one asks for the default chunk
+void omp_set_schedule(omp_sched_t kind, int chunk_size){
+    #if defined DEBUG && defined HPXMP_HAVE_TRACE
+        std::cout<<"omp_set_schedule"<<std::endl;
+    #endif
+    start_backend();
+    switch(kind & ~omp_sched_monotonic) {
+        case omp_sched_static:
+        case omp_sched_dynamic:
+        case omp_sched_guided:
+        case omp_sched_auto:
+        case omp_sched_static_steal:
+            break;
+        default:
+            return;
+    }
+    omp_icv &icv = hpx_backend->get_task_data()->icv;
+    icv.run_sched = kind;
+    icv.run_sched_chunk = (kind & ~omp_sched_monotonic) == omp_sched_auto ? 0 :
+                          std::max(chunk_size, 0);
+}
+
+void omp_get_schedule(omp_sched_t *kind, int *chunk_size){
+    #if defined DEBUG && defined HPXMP_HAVE_TRACE
+        std::cout<<"omp_get_schedule"<<std::endl;
+    #endif
+    start_backend();
+    omp_icv const &icv = hpx_backend->get_task_data()->icv;
+    *kind = static_cast<omp_sched_t>(icv.run_sched & ~omp_sched_nonmonotonic);
+    *chunk_size = icv.run_sched_chunk;
+}
+
 void omp_init_lock(omp_lock_t **lock){
     #if defined DEBUG && defined HPXMP_HAVE_TRACE
         std::cout<<"omp_init_lock"<<std::endl;
@@ -1,9 +1,23 @@
 #include "hpx_runtime.h"
 #include <cstdarg>
 #pragma once
-extern "C" void start_backend();
+extern hpx_runtime *hpx_backend;
+void init_backend();
+
+//This is called where the library calls can potentially be executed
+// outside a parallel region. Only the first call creates the runtime, every
+// later one is a single check that is predicted not taken. The acquire load
+// pairs with the release store in init_backend, so a thread that sees the
+// runtime also sees it fully constructed.
+inline void start_backend()
+{
+    if(HPX_UNLIKELY(__atomic_load_n(&hpx_backend, __ATOMIC_ACQUIRE) == nullptr)) {
+        init_backend();
+    }
+}
 typedef int kmp_int32;
 typedef long long kmp_int64;
+typedef uint64_t kmp_uint64;
 
 typedef mutex_type omp_lock_t;
 
@@ -82,9 +96,26 @@ enum sched_type {
         kmp_nm_ord_auto                   = 198,  /**< auto */
         kmp_nm_ord_trapezoidal            = 199,
         kmp_nm_upper                      = 200,  /**< upper bound for nomerge values */
-        kmp_sch_default = kmp_sch_static  /**< default scheduling algorithm */
+        kmp_sch_default = kmp_sch_static, /**< default scheduling algorithm */
+        kmp_sch_modifier_monotonic        = (1 << 29), /**< monotonic schedule modifier */
+        kmp_sch_modifier_nonmonotonic     = (1 << 30)  /**< nonmonotonic schedule modifier */
 };
 
+//the kinds of omp_set_schedule and the run-sched-var ICV. static_steal is
+// implementation defined, it uses the value libomp gives it.
+typedef enum omp_sched_t {
+        omp_sched_static       = 1,
+        omp_sched_dynamic      = 2,
+        omp_sched_guided       = 3,
+        omp_sched_auto         = 4,
+        omp_sched_static_steal = 102,
+        omp_sched_monotonic    = static_cast<int>(0x80000000u)
+} omp_sched_t;
+
+//kept with omp_sched_dynamic in the run-sched-var ICV for the nonmonotonic
+// modifier of OMP_SCHEDULE, omp_get_schedule does not report it
+const int omp_sched_nonmonotonic = 0x40000000;
+
 
 //changed to forward decleartion because of in gcc_hpxMP, kmp_atomic.h and this header is included.
 struct ident_t {
@@ -100,12 +131,10 @@ typedef struct kmp_tasking_flags {          /* Total struct must be exactly 32 b
     unsigned tiedness    : 1;               /* task is either tied (1) or untied (0) */
     unsigned final       : 1;               /* task is final(1) so execute immediately */
     unsigned merged_if0  : 1;               /* no __kmpc_task_{begin/complete}_if0 calls in if0 code path */
-#if OMP_40_ENABLED
     unsigned destructors_thunk : 1;         /* set if the compiler creates a thunk to invoke destructors from the runtime */
-    unsigned reserved    : 12;              /* reserved for compiler use */
-#else // OMP_40_ENABLED
-    unsigned reserved    : 13;              /* reserved for compiler use */
-#endif // OMP_40_ENABLED
+    unsigned proxy       : 1;               /* task is a proxy task (it will be executed outside the context of the RTL) */
+    unsigned priority_specified : 1;        /* set if the compiler provides priority setting for the task */
+    unsigned reserved    : 10;              /* reserved for compiler use */
     /* Library flags */                     /* Total library flags must be 16 bits */
     unsigned tasktype    : 1;               /* task is either explicit(1) or implicit (0) */
     unsigned task_serial : 1;               /* this task is executed immediately (1) or deferred (0) */
@@ -121,6 +150,12 @@ typedef struct kmp_tasking_flags {          /* Total struct must be exactly 32 b
     unsigned reserved31  : 7;               /* reserved for library use */
 } kmp_tasking_flags_t;
 
+typedef struct kmp_taskgraph_flags {
+    unsigned nowait      : 1;               /* no taskgroup around the region */
+    unsigned re_record   : 1;               /* drop the recorded graph and record again */
+    unsigned reserved    : 30;
+} kmp_taskgraph_flags_t;
+
 
 typedef kmp_int32 (* kmp_routine_entry_t)( kmp_int32, void * );
 
@@ -161,6 +196,14 @@ __kmpc_omp_task_begin_if0( ident_t *loc_ref, kmp_int32 gtid, kmp_task_t * task )
 extern "C" void
 __kmpc_omp_task_complete_if0( ident_t *loc_ref, kmp_int32 gtid, kmp_task_t *task );
 
+extern "C" kmp_int32
+__kmpc_start_record_task( ident_t *loc, kmp_int32 gtid, kmp_int32 input_flags, kmp_int32 tdg_id );
+extern "C" void
+__kmpc_end_record_task( ident_t *loc, kmp_int32 gtid, kmp_int32 input_flags, kmp_int32 tdg_id );
+extern "C" void
+__kmpc_taskloop( ident_t *loc, kmp_int32 gtid, kmp_task_t *task, kmp_int32 if_val,
+                 kmp_uint64 *lb, kmp_uint64 *ub, kmp_int64 st, kmp_int32 nogroup,
+                 kmp_int32 sched, kmp_uint64 grainsize, void *task_dup );
 extern "C" void
 __kmpc_taskgroup( ident_t * loc, int gtid );
 extern "C" void
@@ -244,10 +287,14 @@ extern "C" int  omp_get_num_procs();
 extern "C" double omp_get_wtime();
 extern "C" double omp_get_wtick();
 extern "C" int omp_in_parallel();
+extern "C" int omp_in_final();
+extern "C" int omp_get_max_task_priority();
 
 //ICV get and put functions:
 extern "C" void omp_set_dynamic(int dynamic_threads);
 extern "C" int omp_get_dynamic();
+extern "C" void omp_set_schedule(omp_sched_t kind, int chunk_size);
+extern "C" void omp_get_schedule(omp_sched_t *kind, int *chunk_size);
 
 
 extern "C" void omp_init_lock(omp_lock_t **lock);
@@ -272,5 +319,8 @@ extern "C" int omp_get_nested();
 extern "C" void *__kmpc_task_reduction_init(int gtid, int num, void *data);
 extern "C" void *__kmpc_task_reduction_get_th_data(int gtid, void *tskgrp, void *data);
 void __kmp_task_reduction_fini(void *thr, intrusive_ptr<kmp_taskgroup_t> tg);
+// Gives back the private reduction copies task holds, only the ones of tg
+// unless it is NULL. Called before the task counts as finished.
+void release_reduction_copies(omp_task_data *task, kmp_taskgroup_t *tg = NULL);
 #endif
 
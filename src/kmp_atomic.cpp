@@ -38,7 +38,7 @@
 typedef unsigned char uchar;
 typedef unsigned short ushort;
 
-extern boost::shared_ptr<hpx_runtime> hpx_backend;
+extern hpx_runtime *hpx_backend;
 /*!
 @defgroup ATOMIC_OPS Atomic Operations
 These functions are used for implementing the many different varieties of atomic operations.
@@ -99,6 +99,15 @@
 #define KMP_API_NAME_GOMP_SECTIONS_END_CANCEL            GOMP_sections_end_cancel
 #define KMP_API_NAME_GOMP_TASKGROUP_START                GOMP_taskgroup_start
 #define KMP_API_NAME_GOMP_TASKGROUP_END                  GOMP_taskgroup_end
+/* GOMP_4.5 symbols */
+#define KMP_API_NAME_GOMP_TASKLOOP                       GOMP_taskloop
+#define KMP_API_NAME_GOMP_TASKLOOP_ULL                   GOMP_taskloop_ull
+#define KMP_API_NAME_GOMP_LOOP_NONMONOTONIC_DYNAMIC_START GOMP_loop_nonmonotonic_dynamic_start
+#define KMP_API_NAME_GOMP_LOOP_NONMONOTONIC_DYNAMIC_NEXT  GOMP_loop_nonmonotonic_dynamic_next
+#define KMP_API_NAME_GOMP_LOOP_ULL_NONMONOTONIC_DYNAMIC_START GOMP_loop_ull_nonmonotonic_dynamic_start
+#define KMP_API_NAME_GOMP_LOOP_ULL_NONMONOTONIC_DYNAMIC_NEXT  GOMP_loop_ull_nonmonotonic_dynamic_next
+/* GOMP_5.0 symbols */
+#define KMP_API_NAME_GOMP_TASKWAIT_DEPEND                GOMP_taskwait_depend
 /* Target functions should be taken care of by liboffload */
 #define KMP_API_NAME_GOMP_TARGET                         GOMP_target
 #define KMP_API_NAME_GOMP_TARGET_DATA                    GOMP_target_data
@@ -1,8 +1,9 @@
+#include <algorithm>
 #include <iostream>
 #include "loop_schedule.h"
 #include <thread>
 
-extern boost::shared_ptr<hpx_runtime> hpx_backend;
+extern hpx_runtime *hpx_backend;
 
 using std::cout;
 using std::endl;
@@ -113,35 +114,274 @@ __kmpc_for_static_fini( ident_t *loc, int32_t gtid ){
 //Dynamic loops:
 //------------------------------------------------------------------------
 
+// The schedule and chunk size a schedule(runtime) loop gets from the
+// run-sched-var ICV. Like the clause form, a nonmonotonic dynamic schedule
+// steals. Ordered loops have to hand out their chunks in order, static_steal
+// and auto fall back to dynamic for them.
+template<typename D>
+static int runtime_schedule( omp_icv const &icv, bool ordered, D &chunk )
+{
+    chunk = icv.run_sched_chunk;
+    bool nonmonotonic = icv.run_sched & omp_sched_nonmonotonic;
+    switch(icv.run_sched & ~(omp_sched_monotonic | omp_sched_nonmonotonic)) {
+        case omp_sched_static:
+            return chunk > 0 ? kmp_sch_static_chunked : kmp_sch_static;
+        case omp_sched_guided:
+            return kmp_sch_guided_chunked;
+        case omp_sched_static_steal:
+            return ordered ? kmp_sch_dynamic_chunked : kmp_sch_static_steal;
+        case omp_sched_auto:
+            return ordered ? kmp_sch_dynamic_chunked : kmp_sch_auto;
+        default:
+            return nonmonotonic && !ordered ? kmp_sch_static_steal : kmp_sch_dynamic_chunked;
+    }
+}
+
+// What the last runs of one schedule(auto) loop looked like. Every run
+// measures the time from setting the loop up to the first and to the last
+// thread leaving it. A loop whose threads leave close together stays static,
+// otherwise static_steal and guided get a try and the choice with the lowest
+// time per iteration is kept. Every auto_reprobe runs of another choice static
+// gets a new try, the loop may have become balanced.
+// Loops are told apart by a site passed to scheduler_init rather than by
+// their ident_t, clang shares one ident_t between all loops of a file compiled
+// without debug info. The __kmpc entry points pass their return address, the
+// GOMP ones the return address of the GOMP entry point.
+enum auto_choice { auto_static, auto_steal, auto_guided, auto_choices };
+
+struct auto_loop_stats {
+    atomic<void const*> site{nullptr};
+    mutex_type mtx;
+    int choice{auto_static};
+    int runs{0};
+    //average time per iteration in ns, zero until the choice ran
+    double cost[auto_choices] = {};
+};
+
+static const int auto_table_size = 256;
+static const int auto_reprobe = 16;
+//idle time of the first thread to leave, relative to the run time
+static const double auto_balanced_skew = 0.05;
+//dynamic choices hand out at least this many chunks per thread
+static const int auto_chunks_per_thread = 64;
+static auto_loop_stats auto_table[auto_table_size];
+
+// The statistics of the loop called from site, nullptr once the table is full.
+static auto_loop_stats* auto_stats_for( void const *site )
+{
+    std::size_t hash = reinterpret_cast<std::uintptr_t>(site) >> 4;
+    for(int i = 0; i < auto_table_size; i++) {
+        auto_loop_stats &stats = auto_table[(hash + i) % auto_table_size];
+        void const *key = stats.site.load(std::memory_order_acquire);
+        if(key == nullptr &&
+           stats.site.compare_exchange_strong(key, site, std::memory_order_acq_rel)) {
+            return &stats;
+        }
+        if(key == site) {
+            return &stats;
+        }
+    }
+    return nullptr;
+}
+
+// Called by the last thread to leave a schedule(auto) loop at time end,
+// picks the schedule of the next run.
+static void auto_record( loop_data &loop, std::uint64_t end )
+{
+    auto_loop_stats *stats = loop.auto_stats;
+    if(loop.total_iter <= 0 || end <= loop.start_time) {
+        return;
+    }
+    double elapsed = static_cast<double>(end - loop.start_time);
+    double skew = static_cast<double>(end - loop.first_finish.load(std::memory_order_relaxed)) / elapsed;
+    double cost = elapsed / loop.total_iter;
+
+    std::lock_guard<mutex_type> l(stats->mtx);
+    double &average = stats->cost[loop.auto_choice];
+    average = average == 0 ? cost : 0.75 * average + 0.25 * cost;
+
+    if(loop.auto_choice == auto_static && skew <= auto_balanced_skew) {
+        stats->choice = auto_static;
+        stats->runs = 0;
+        return;
+    }
+    if(loop.auto_choice != auto_static && ++stats->runs >= auto_reprobe) {
+        stats->choice = auto_static;
+        stats->runs = 0;
+        return;
+    }
+    int best = auto_static;
+    for(int c = auto_steal; c < auto_choices; c++) {
+        if(stats->cost[c] == 0) {
+            best = c;
+            break;
+        }
+        if(stats->cost[c] < stats->cost[best]) {
+            best = c;
+        }
+    }
+    stats->choice = best;
+}
+
+// The slot of loop number loop_num of the team, see parallel_region.
+static loop_data& loop_slot( parallel_region *team, int loop_num )
+{
+    return team->loop_ring[loop_num % parallel_region::loop_ring_size];
+}
+
 //D is the signed version of T, for when T is unsigned
 template<typename T, typename D=T>
-void scheduler_init( int gtid, int schedtype, T lower, T upper, D stride, D chunk) {
-    auto task = hpx_backend->get_task_data();
-    auto team = hpx_backend->get_team();
-
-    //Is there ever a case where num_threads would be different than the number of threads in a current team?
-    int NT = team->num_threads;
-    team->loop_mtx.lock(); //making every thread wait here, until the struct is created.
-    if(team->loop_list.size() == static_cast<std::size_t>(task->loop_num)) {//first to loop
-        if( kmp_ord_lower & schedtype ) {
-            schedtype -= (kmp_ord_lower - kmp_sch_lower);
-        }
-        if( stride == 0 ) {
-            stride = 1;
+void scheduler_init( int gtid, void const *site, int schedtype,
+                     T lower, T upper, D stride, D chunk) {
+    omp_task_data *task = hpx_backend->current_task();
+    parallel_region *team = task->team;
+    loop_data &loop = loop_slot(team, task->loop_num);
+    unsigned free_seq = 2 * static_cast<unsigned>(task->loop_num);
+
+    //the first thread to get here sets the slot up, the others wait for it.
+    // A slot is still busy while a thread has not left the loop that used it
+    // loop_ring_size loops ago.
+    for(;;) {
+        unsigned seq = loop.seq.load(std::memory_order_acquire);
+        if(seq == free_seq + 2) {
+            break;
         }
-        if( chunk == 0 ) {
-            chunk = 1;
+        if(seq == free_seq &&
+           loop.seq.compare_exchange_strong(seq, free_seq + 1, std::memory_order_acquire)) {
+            //every schedule here is monotonic, but nonmonotonic dynamic
+            // loops may as well steal
+            bool nonmonotonic = schedtype & kmp_sch_modifier_nonmonotonic;
+            schedtype &= ~(kmp_sch_modifier_monotonic | kmp_sch_modifier_nonmonotonic);
+            if( nonmonotonic && schedtype == kmp_sch_dynamic_chunked ) {
+                schedtype = kmp_sch_static_steal;
+            }
+            if( schedtype == kmp_sch_runtime || schedtype == kmp_ord_runtime ) {
+                schedtype = runtime_schedule(task->icv, schedtype == kmp_ord_runtime, chunk);
+            }
+            if( schedtype == kmp_ord_auto ) {
+                schedtype = kmp_ord_dynamic_chunked;
+            }
+            auto_loop_stats *stats = nullptr;
+            int choice = auto_guided;
+            bool is_auto = schedtype == kmp_sch_auto;
+            if( is_auto ) {
+                stats = auto_stats_for(site);
+                if( stats ) {
+                    std::lock_guard<mutex_type> l(stats->mtx);
+                    choice = stats->choice;
+                }
+                schedtype = choice == auto_static ? kmp_sch_static :
+                            choice == auto_steal  ? kmp_sch_static_steal :
+                                                    kmp_sch_guided_chunked;
+            }
+            if( kmp_ord_lower & schedtype ) {
+                schedtype -= (kmp_ord_lower - kmp_sch_lower);
+            }
+            if( stride == 0 ) {
+                stride = 1;
+            }
+            if( chunk == 0 ) {
+                chunk = 1;
+            }
+            loop.init(lower, upper, stride, chunk, schedtype);
+            //fewer, bigger chunks than the default of one iteration
+            if( is_auto && choice != auto_static ) {
+                loop.chunk = std::max(loop.chunk,
+                    loop.total_iter / (loop.num_threads * auto_chunks_per_thread));
+            }
+            if( stats ) {
+                loop.auto_stats = stats;
+                loop.auto_choice = choice;
+                loop.first_finish = std::numeric_limits<std::uint64_t>::max();
+                loop.start_time = hpx::util::high_resolution_clock::now();
+            }
+            if( schedtype == kmp_sch_static_steal ) {
+                //every thread starts out with its static block
+                std::int64_t total = std::max(loop.total_iter, 0);
+                for(int i = 0; i < loop.num_threads; i++) {
+                    loop.steal_ranges[i].set(total * i / loop.num_threads,
+                                             total * (i + 1) / loop.num_threads);
+                }
+            }
+            loop.seq.store(free_seq + 2, std::memory_order_release);
+            break;
         }
-        team->loop_list.emplace_back( loop_data(NT, lower, upper, stride, chunk, schedtype) );
+        loop.yield();
     }
-    team->loop_mtx.unlock();
 
-    team->loop_list[task->loop_num].first_iter[gtid] = 0;
-    team->loop_list[task->loop_num].last_iter[gtid]  = 0;
-    team->loop_list[task->loop_num].iter_count[gtid] = 0;
+    loop.first_iter[gtid] = 0;
+    loop.last_iter[gtid]  = 0;
+    loop.iter_count[gtid] = 0;
     task->loop_num++;
 }
 
+// static_steal: takes the next chunk off the bottom of the own range.
+static bool take_own_chunk( loop_data &loop, int gtid, int &first, int &size )
+{
+    auto &bounds = loop.steal_ranges[gtid].bounds;
+    std::uint64_t cur = bounds.load(std::memory_order_acquire);
+    std::uint32_t lower, upper;
+    do {
+        lower = static_cast<std::uint32_t>(cur);
+        upper = static_cast<std::uint32_t>(cur >> 32);
+        if(lower >= upper) {
+            return false;
+        }
+        size = std::min<std::uint32_t>(loop.chunk, upper - lower);
+    } while(!bounds.compare_exchange_weak(cur,
+                loop_data::steal_range::pack(lower + size, upper),
+                std::memory_order_acq_rel, std::memory_order_acquire));
+    first = lower;
+    return true;
+}
+
+// static_steal: moves the upper half of the first range with iterations left
+// into the own range, which is empty. A range in transit is still run by the
+// thief, so finding nothing means the loop is done for this thread.
+static bool steal_range( loop_data &loop, int gtid )
+{
+    int nt = loop.num_threads;
+    for(int i = 1; i < nt; i++) {
+        auto &bounds = loop.steal_ranges[(gtid + i) % nt].bounds;
+        std::uint64_t cur = bounds.load(std::memory_order_acquire);
+        for(;;) {
+            std::uint32_t lower = static_cast<std::uint32_t>(cur);
+            std::uint32_t upper = static_cast<std::uint32_t>(cur >> 32);
+            if(lower >= upper) {
+                break;
+            }
+            std::uint32_t middle = lower + (upper - lower) / 2;
+            if(bounds.compare_exchange_weak(cur, loop_data::steal_range::pack(lower, middle),
+                   std::memory_order_acq_rel, std::memory_order_acquire)) {
+                loop.steal_ranges[gtid].set(middle, upper);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Called once per thread, when it gets no further chunk of the loop. The last
+// one hands the slot on to the loop loop_ring_size loops later.
+static void loop_exit( loop_data &loop, int loop_num )
+{
+    std::uint64_t now = 0;
+    if(loop.auto_stats) {
+        now = hpx::util::high_resolution_clock::now();
+        std::uint64_t first = loop.first_finish.load(std::memory_order_relaxed);
+        while(now < first &&
+              !loop.first_finish.compare_exchange_weak(first, now, std::memory_order_relaxed)) {
+        }
+    }
+    if(loop.finished.fetch_add(1, std::memory_order_acq_rel) + 1 == loop.num_threads) {
+        if(loop.auto_stats) {
+            auto_record(loop, now);
+        }
+        loop.finished.store(0, std::memory_order_relaxed);
+        loop.seq.store(2 * static_cast<unsigned>(loop_num + parallel_region::loop_ring_size),
+                       std::memory_order_release);
+    }
+}
 
 void 
 __kmpc_dispatch_init_4( ident_t *loc, int32_t gtid, enum sched_type schedule,
@@ -149,7 +389,7 @@ __kmpc_dispatch_init_4( ident_t *loc, int32_t gtid, enum sched_type schedule,
     #if defined DEBUG && defined HPXMP_HAVE_TRACE
         std::cout<<"__kmpc_dispatch_init_4"<<std::endl;
     #endif
-    scheduler_init<int32_t>( gtid, schedule, lb, ub, st, chunk );
+    scheduler_init<int32_t>( gtid, __builtin_return_address(0), schedule, lb, ub, st, chunk );
 }
 
 void
@@ -159,7 +399,7 @@ __kmpc_dispatch_init_4u( ident_t *loc, int32_t gtid, enum sched_type schedule,
     #if defined DEBUG && defined HPXMP_HAVE_TRACE
         std::cout<<"__kmpc_dispatch_init_4u"<<std::endl;
     #endif
-    scheduler_init<uint32_t, int32_t>( gtid, schedule, lb, ub, st, chunk );
+    scheduler_init<uint32_t, int32_t>( gtid, __builtin_return_address(0), schedule, lb, ub, st, chunk );
 }
 
 void
@@ -169,7 +409,7 @@ __kmpc_dispatch_init_8( ident_t *loc, int32_t gtid, enum sched_type schedule,
     #if defined DEBUG && defined HPXMP_HAVE_TRACE
         std::cout<<"__kmpc_dispatch_init_8"<<std::endl;
     #endif
-    scheduler_init<int64_t>( gtid, schedule, lb, ub, st, chunk );
+    scheduler_init<int64_t>( gtid, __builtin_return_address(0), schedule, lb, ub, st, chunk );
 }
 
 void
@@ -179,14 +419,25 @@ __kmpc_dispatch_init_8u( ident_t *loc, int32_t gtid, enum sched_type schedule,
     #if defined DEBUG && defined HPXMP_HAVE_TRACE
         std::cout<<"__kmpc_dispatch_init_8u"<<std::endl;
     #endif
-    scheduler_init<uint64_t, int64_t>( gtid, schedule, lb, ub, st, chunk );
+    scheduler_init<uint64_t, int64_t>( gtid, __builtin_return_address(0), schedule, lb, ub, st, chunk );
+}
+
+void
+__kmp_dispatch_init_8( int32_t gtid, void const *site, enum sched_type schedule,
+                       int64_t lb, int64_t ub, int64_t st, int64_t chunk ) {
+    scheduler_init<int64_t>( gtid, site, schedule, lb, ub, st, chunk );
+}
+
+void
+__kmp_dispatch_init_8u( int32_t gtid, void const *site, enum sched_type schedule,
+                        uint64_t lb, uint64_t ub, int64_t st, int64_t chunk ) {
+    scheduler_init<uint64_t, int64_t>( gtid, site, schedule, lb, ub, st, chunk );
 }
 
 //return one if there is work to be done, zero otherwise
 template<typename T, typename D=T>
-int kmp_next( int gtid, int *p_last, T *p_lower, T *p_upper, D *p_stride ) {
-    int current_loop = hpx_backend->get_task_data()->loop_num - 1;
-    auto loop_sched = &(hpx_backend->get_team()->loop_list[current_loop]);
+int kmp_next_chunk( int gtid, int *p_last, T *p_lower, T *p_upper, D *p_stride,
+                    loop_data *loop_sched ) {
     int schedule = loop_sched->schedule;
     //auto team = hpx_backend->get_team();
     T init;
@@ -220,59 +471,104 @@ int kmp_next( int gtid, int *p_last, T *p_lower, T *p_upper, D *p_stride ) {
 
         case kmp_sch_static_chunked: //1668
         case kmp_ord_static_chunked:
+        {
+            //chunks are dealt out round robin, this thread gets chunks
+            // gtid, gtid + num_threads, ...
+            std::int64_t first = static_cast<std::int64_t>(loop_sched->chunk) *
+                (gtid + static_cast<std::int64_t>(loop_sched->num_threads) *
+                 loop_sched->iter_count[gtid]);
+            if(first >= loop_sched->total_iter) {
+                return 0;
+            }
+            int size = static_cast<int>(std::min<std::int64_t>(loop_sched->chunk,
+                                                               loop_sched->total_iter - first));
+            loop_sched->iter_count[gtid]++;
 
-            loop_sched->schedule_count += loop_sched->chunk;
-            loop_id = loop_sched->iter_count[gtid];
+            *p_stride = loop_sched->stride;
+            *p_lower  = loop_sched->lower + first * (*p_stride);
+            *p_upper  = *p_lower + (size - 1) * (*p_stride);
 
-            loop_sched->first_iter[gtid] = gtid + loop_sched->iter_count[gtid] * loop_sched->stride * loop_sched->num_threads;
-            loop_sched->last_iter[gtid] = loop_sched->first_iter[gtid] + loop_sched->stride;
+            //only used for ordered
+            loop_sched->first_iter[gtid] = static_cast<int>(first);
+            loop_sched->last_iter[gtid] = static_cast<int>(first) + size - 1;
+            if(p_last)
+                *p_last = (first + size == loop_sched->total_iter);
+            return 1;
+        }
 
-            loop_sched->iter_count[gtid]++;
+        case kmp_sch_guided_chunked:
+        case kmp_ord_guided_chunked:
+        {
+            //schedule_count is the number of iterations handed out so far.
+            // Every grab takes half of the remaining iterations per thread,
+            // but no less than the chunk size, claimed with one CAS.
+            int first = loop_sched->schedule_count.load(std::memory_order_relaxed);
+            int size;
+            do {
+                int remaining = loop_sched->total_iter - first;
+                if(remaining <= 0) {
+                    return 0;
+                }
+                size = std::max(remaining / (2 * loop_sched->num_threads), loop_sched->chunk);
+                size = std::min(size, remaining);
+            } while(!loop_sched->schedule_count.compare_exchange_weak(first, first + size,
+                        std::memory_order_relaxed));
 
             *p_stride = loop_sched->stride;
-            *p_lower  = loop_sched->lower + loop_sched->chunk * \
-                        ( gtid + loop_sched->num_threads * (*p_stride) * loop_id);
-            //FIXME: this logic is wrong
-            *p_upper  = *p_lower + (*p_stride) * ( loop_sched->chunk - 1 );
+            *p_lower = loop_sched->lower + first * (*p_stride);
+            *p_upper = *p_lower + (size - 1) * (*p_stride);
 
-            if(p_last && *p_upper == static_cast<T>(loop_sched->upper)) {
-                *p_last = 1;
-            }
-            if(*p_upper > static_cast<T>(loop_sched->upper)) {
-                *p_upper = loop_sched->upper;//not sure this is 100% correct
-            }
-            if(*p_lower >  static_cast<T>(loop_sched->upper)) {
-                return 0;
+            //only used for ordered
+            loop_sched->first_iter[gtid] = first;
+            loop_sched->last_iter[gtid] = first + size - 1;
+            if(p_last)
+                *p_last = (first + size == loop_sched->total_iter);
+            return 1;
+        }
+
+        case kmp_sch_static_steal:
+        {
+            int first, size;
+            while(!take_own_chunk(*loop_sched, gtid, first, size)) {
+                if(!steal_range(*loop_sched, gtid)) {
+                    return 0;
+                }
             }
+
+            *p_stride = loop_sched->stride;
+            *p_lower = loop_sched->lower + first * (*p_stride);
+            *p_upper = *p_lower + (size - 1) * (*p_stride);
+
+            loop_sched->first_iter[gtid] = first;
+            loop_sched->last_iter[gtid] = first + size - 1;
+            if(p_last)
+                *p_last = (first + size == loop_sched->total_iter);
             return 1;
+        }
 
-        case kmp_sch_guided_chunked:
         case kmp_sch_dynamic_chunked:
         case kmp_ord_dynamic_chunked:
-        case kmp_ord_guided_chunked:
-        case kmp_sch_runtime:
-        case kmp_ord_runtime:
-
+        {
+            //schedule_count is the number of chunks handed out so far
             loop_id = loop_sched->schedule_count++;
+            std::int64_t first = static_cast<std::int64_t>(loop_id) * loop_sched->chunk;
+            if(first >= loop_sched->total_iter) {
+                return 0;
+            }
+            int size = static_cast<int>(std::min<std::int64_t>(loop_sched->chunk,
+                                                               loop_sched->total_iter - first));
 
             *p_stride = loop_sched->stride;
-            *p_lower = loop_sched->lower + (loop_id * (*p_stride) * loop_sched->chunk);
-            *p_upper = *p_lower + (loop_sched->chunk - 1) * (*p_stride);
+            *p_lower = loop_sched->lower + first * (*p_stride);
+            *p_upper = *p_lower + (size - 1) * (*p_stride);
 
             //only used for ordered
-            loop_sched->first_iter[gtid] = loop_id;
-            loop_sched->last_iter[gtid] = loop_sched->first_iter[gtid] + loop_sched->chunk;
+            loop_sched->first_iter[gtid] = static_cast<int>(first);
+            loop_sched->last_iter[gtid] = static_cast<int>(first) + size - 1;
             if(p_last)
-                *p_last = 0;
-            if(*p_lower >  static_cast<T>(loop_sched->upper)) {
-                return 0;
-            }
-            if(*p_upper >  static_cast<T>(loop_sched->upper)) {
-                *p_upper = loop_sched->upper;
-                if(p_last)
-                    *p_last = 1;
-            }
+                *p_last = (first + size == loop_sched->total_iter);
             return 1;
+        }
 
         default:
             if(gtid == 0) {
@@ -282,6 +578,19 @@ int kmp_next( int gtid, int *p_last, T *p_lower, T *p_upper, D *p_stride ) {
     return 0;
 }
 
+template<typename T, typename D=T>
+int kmp_next( int gtid, int *p_last, T *p_lower, T *p_upper, D *p_stride ) {
+    omp_task_data *task = hpx_backend->current_task();
+    int current_loop = task->loop_num - 1;
+    loop_data &loop = loop_slot(task->team, current_loop);
+    int status = kmp_next_chunk<T, D>(gtid, p_last, p_lower, p_upper, p_stride, &loop);
+    //the slot may be reused as soon as this returns
+    if(!status) {
+        loop_exit(loop, current_loop);
+    }
+    return status;
+}
+
 int
 __kmpc_dispatch_next_4( ident_t *loc, int32_t gtid, int32_t *p_last,
                         int32_t *p_lb, int32_t *p_ub, int32_t *p_st ){
@@ -346,8 +655,9 @@ void __kmpc_ordered(ident_t *, kmp_int32 global_tid ) {
     #if defined DEBUG && defined HPXMP_HAVE_TRACE
         std::cout<<"__kmpc_ordered"<<std::endl;
     #endif
-    int current_loop = hpx_backend->get_task_data()->loop_num - 1;
-    auto loop_sched = &(hpx_backend->get_team()->loop_list[ current_loop ]);
+    omp_task_data *task = hpx_backend->current_task();
+    int current_loop = task->loop_num - 1;
+    auto loop_sched = &loop_slot(task->team, current_loop);
     while( loop_sched->ordered_count < loop_sched->first_iter[global_tid] ||
            loop_sched->ordered_count > loop_sched->last_iter[global_tid] ) {
         loop_sched->yield();
@@ -358,7 +668,8 @@ void __kmpc_end_ordered(ident_t *, kmp_int32 global_tid ) {
     #if defined DEBUG && defined HPXMP_HAVE_TRACE
         std::cout<<"__kmpc_end_ordered"<<std::endl;
     #endif
-    int current_loop = hpx_backend->get_task_data()->loop_num - 1;
-    auto loop_sched = &(hpx_backend->get_team()->loop_list[ current_loop ]);
+    omp_task_data *task = hpx_backend->current_task();
+    int current_loop = task->loop_num - 1;
+    auto loop_sched = &loop_slot(task->team, current_loop);
     loop_sched->ordered_count++;
 }
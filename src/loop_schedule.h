@@ -51,6 +51,16 @@ __kmpc_dispatch_init_8u( ident_t *loc, int32_t gtid, enum sched_type schedule,
                          uint64_t lb, uint64_t ub, 
                          int64_t st, int64_t chunk );
 
+// Used by the GOMP entry points, site is where the user code called them,
+// it tells loops apart for schedule(auto).
+void
+__kmp_dispatch_init_8( int32_t gtid, void const *site, enum sched_type schedule,
+                       int64_t lb, int64_t ub, int64_t st, int64_t chunk );
+
+void
+__kmp_dispatch_init_8u( int32_t gtid, void const *site, enum sched_type schedule,
+                        uint64_t lb, uint64_t ub, int64_t st, int64_t chunk );
+
 extern "C" int
 __kmpc_dispatch_next_4( ident_t *loc, int32_t gtid, int32_t *p_last,
                         int32_t *p_lb, int32_t *p_ub, int32_t *p_st );
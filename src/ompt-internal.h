@@ -136,7 +136,7 @@ extern ompt_callbacks_active_t ompt_enabled;
  * types from ompt-specific.h
  ***************************************************************************/
 typedef omp_task_data ompt_thread_t;
-extern boost::shared_ptr<hpx_runtime> hpx_backend;
+extern hpx_runtime *hpx_backend;
 ompt_data_t *__ompt_get_thread_data_internal();
 ompt_data_t* __ompt_get_parallel_data_internal();
 int __ompt_get_task_info_internal(int ancestor_level, int* type,
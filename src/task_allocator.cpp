@@ -0,0 +1,140 @@
+//  Copyright (c) 2018 Tianyi Zhang
+//
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#include "task_allocator.h"
+
+#include <hpx/hpx.hpp>
+
+#include <new>
+#include <ostream>
+
+//never destroyed, tasks are still released from fini_runtime which may run
+// after static destructors
+task_allocator& task_allocator::get_instance()
+{
+    static task_allocator *allocator = new task_allocator;
+    return *allocator;
+}
+
+void task_allocator::init(std::size_t workers)
+{
+    pools = make_aligned_array<worker_pool>(workers);
+    for(std::size_t i = 0; i < workers; i++) {
+        for(std::size_t c = 0; c < num_classes; c++) {
+            pools[i].remote[c].store(nullptr, std::memory_order_relaxed);
+        }
+    }
+    num_workers = workers;
+}
+
+std::size_t task_allocator::size_class(std::size_t size)
+{
+    std::size_t cls = 0;
+    std::size_t block = min_block;
+    while(cls < num_classes && block < size) {
+        block <<= 1;
+        cls++;
+    }
+    return cls;
+}
+
+//slabs are never handed back, tasks may still be released while the
+// runtime shuts down
+task_allocator::free_block* task_allocator::refill(worker_pool &pool, std::size_t cls)
+{
+    std::size_t block = min_block << cls;
+    char *slab = static_cast<char*>(::operator new(slab_size));
+    free_block *head = nullptr;
+    for(std::size_t offset = slab_size; offset >= block; offset -= block) {
+        free_block *b = reinterpret_cast<free_block*>(slab + offset - block);
+        b->next = head;
+        head = b;
+    }
+    pool.slabs++;
+    return head;
+}
+
+void* task_allocator::allocate(std::size_t size)
+{
+    std::size_t total = size + sizeof(block_header);
+    std::size_t cls = size_class(total);
+    std::size_t worker = hpx::get_worker_thread_num();
+
+    block_header *header;
+    if(cls == num_classes || worker >= num_workers) {
+        if(cls == num_classes) {
+            ++large_allocs;
+        } else {
+            ++foreign_allocs;
+        }
+        header = static_cast<block_header*>(::operator new(total));
+        header->owner = no_owner;
+    } else {
+        //an hpx thread is only moved to another worker when it suspends, so
+        // the pool stays ours until we return
+        worker_pool &pool = pools[worker];
+        free_block *b = pool.local[cls];
+        if(b == nullptr) {
+            b = pool.remote[cls].exchange(nullptr, std::memory_order_acquire);
+        }
+        if(b == nullptr) {
+            b = refill(pool, cls);
+            pool.misses++;
+        } else {
+            pool.hits++;
+        }
+        pool.local[cls] = b->next;
+        header = reinterpret_cast<block_header*>(b);
+        header->owner = static_cast<std::uint32_t>(worker);
+    }
+    header->size_class = static_cast<std::uint32_t>(cls);
+    return header + 1;
+}
+
+void task_allocator::deallocate(void *p)
+{
+    if(p == nullptr)
+        return;
+    block_header *header = static_cast<block_header*>(p) - 1;
+    std::uint32_t owner = header->owner;
+    std::uint32_t cls = header->size_class;
+    if(owner == no_owner) {
+        ::operator delete(header);
+        return;
+    }
+    worker_pool &pool = pools[owner];
+    free_block *b = reinterpret_cast<free_block*>(header);
+    if(owner == hpx::get_worker_thread_num()) {
+        b->next = pool.local[cls];
+        pool.local[cls] = b;
+    } else {
+        //the owner only ever takes the whole stack, so a plain push is ABA free
+        free_block *head = pool.remote[cls].load(std::memory_order_relaxed);
+        do {
+            b->next = head;
+        } while(!pool.remote[cls].compare_exchange_weak(head, b,
+                    std::memory_order_release, std::memory_order_relaxed));
+        pool.remote_frees.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void task_allocator::print_stats(std::ostream &os) const
+{
+    std::size_t hits = 0, misses = 0, slabs = 0, remote_frees = 0;
+    for(std::size_t i = 0; i < num_workers; i++) {
+        hits += pools[i].hits;
+        misses += pools[i].misses;
+        slabs += pools[i].slabs;
+        remote_frees += pools[i].remote_frees.load(std::memory_order_relaxed);
+    }
+    os << "hpxMP task allocator: "
+       << hits << " hits, "
+       << misses << " misses, "
+       << slabs << " slabs of " << slab_size << " bytes, "
+       << remote_frees << " remote frees, "
+       << large_allocs.load() << " large, "
+       << foreign_allocs.load() << " from non-hpx threads"
+       << std::endl;
+}
@@ -0,0 +1,109 @@
+//  Copyright (c) 2018 Tianyi Zhang
+//
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iosfwd>
+#include <memory>
+#include <new>
+
+// Arrays of per worker data that keep every element on cache lines of its
+// own. Before C++17 operator new ignores an alignas above the alignment of
+// std::max_align_t, so the storage comes from posix_memalign.
+template <typename T>
+struct aligned_array_deleter {
+    std::size_t size;
+
+    void operator()(T *p) const
+    {
+        for(std::size_t i = size; i > 0; i--) {
+            p[i - 1].~T();
+        }
+        std::free(p);
+    }
+};
+
+template <typename T>
+using aligned_array = std::unique_ptr<T[], aligned_array_deleter<T>>;
+
+template <typename T>
+aligned_array<T> make_aligned_array(std::size_t size)
+{
+    void *p = nullptr;
+    if(posix_memalign(&p, alignof(T), size * sizeof(T)) != 0) {
+        throw std::bad_alloc();
+    }
+    T *elements = static_cast<T*>(p);
+    for(std::size_t i = 0; i < size; i++) {
+        new(elements + i) T();
+    }
+    return aligned_array<T>(elements, aligned_array_deleter<T>{size});
+}
+
+// Size-class slab pools for explicit task descriptors and task data.
+//
+// Every hpx worker owns one free list per size class and carves new blocks
+// out of slabs it allocates itself. A block always goes back to the worker
+// that handed it out: the owner pushes it onto its local list, any other
+// thread pushes it onto the owner's remote free stack, which the owner takes
+// over as a whole once its local list runs dry. Threads that are not hpx
+// workers and blocks bigger than the largest class use operator new.
+class task_allocator {
+    public:
+        static task_allocator& get_instance();
+
+        // sets up the per worker pools, called once the hpx workers exist.
+        // Allocations before that go to operator new.
+        void init(std::size_t num_workers);
+
+        void* allocate(std::size_t size);
+        void deallocate(void *p);
+
+        void print_stats(std::ostream &os) const;
+
+    private:
+        task_allocator() = default;
+        task_allocator(task_allocator const&) = delete;
+        task_allocator& operator=(task_allocator const&) = delete;
+
+        static const std::size_t num_classes = 6;       // 64 bytes .. 2 KiB
+        static const std::size_t min_block = 64;
+        static const std::size_t slab_size = 64 * 1024;
+        static const std::uint32_t no_owner = ~std::uint32_t(0);
+
+        // placed in front of every block, 16 bytes keep the user part
+        // 16 byte aligned
+        struct block_header {
+            std::uint32_t owner;
+            std::uint32_t size_class;
+            std::uint64_t reserved;
+        };
+        // a free block reuses the space of its header
+        struct free_block {
+            free_block *next;
+        };
+
+        // a cache line each, neighbouring pools do not share one
+        struct alignas(64) worker_pool {
+            free_block *local[num_classes] = {};
+            std::atomic<free_block*> remote[num_classes];
+            // only updated by the owning worker
+            std::size_t hits{0};
+            std::size_t misses{0};
+            std::size_t slabs{0};
+            std::atomic<std::size_t> remote_frees{0};
+        };
+
+        static std::size_t size_class(std::size_t size);
+        free_block* refill(worker_pool &pool, std::size_t cls);
+
+        aligned_array<worker_pool> pools;
+        std::size_t num_workers{0};
+        std::atomic<std::size_t> large_allocs{0};
+        std::atomic<std::size_t> foreign_allocs{0};
+};
@@ -0,0 +1,48 @@
+//  Copyright (c) 2018 Tianyi Zhang
+//
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#include <omp.h>
+#include <stdio.h>
+#include <vector>
+
+//schedule(auto) picks a different schedule from run to run of the same
+// loop, every pick has to run each iteration exactly once
+int main()
+{
+    const int n = 1000;
+    std::vector<int> balanced(n, 0), irregular(n, 0);
+    int i;
+
+    for (int run = 0; run < 40; run++)
+    {
+#pragma omp parallel for schedule(auto)
+        for (i = 0; i < n; i++)
+        {
+#pragma omp atomic
+            balanced[i]++;
+        }
+
+#pragma omp parallel for schedule(auto)
+        for (i = n - 1; i >= 0; i--)
+        {
+            volatile int work = 0;
+            for (int j = 0; j < (i < n / 8 ? 20000 : 10); j++)
+                work += j;
+#pragma omp atomic
+            irregular[i]++;
+        }
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        if (balanced[i] != 40 || irregular[i] != 40)
+        {
+            printf("iteration %d ran %d and %d times\n", i, balanced[i],
+                irregular[i]);
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,53 @@
+//  Copyright (c) 2018 Tianyi Zhang
+//
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#include <omp.h>
+#include <stdio.h>
+#include <vector>
+
+int main()
+{
+    const int n = 1000;
+    std::vector<int> count(n, 0);
+    std::vector<int> order;
+    int i;
+
+    //every iteration runs exactly once, with shrinking chunks
+#pragma omp parallel for schedule(guided, 3)
+    for (i = 0; i < n; i++)
+    {
+#pragma omp atomic
+        count[i]++;
+    }
+
+#pragma omp parallel for schedule(guided)
+    for (i = n - 1; i >= 0; i -= 2)
+    {
+#pragma omp atomic
+        count[i]++;
+    }
+
+#pragma omp parallel for schedule(guided, 2) ordered
+    for (i = 0; i < 100; i++)
+    {
+#pragma omp ordered
+        order.push_back(i);
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        if (count[i] != 1 + (i % 2))
+        {
+            printf("iteration %d ran %d times\n", i, count[i]);
+            return 1;
+        }
+    }
+    for (i = 0; i < 100; i++)
+    {
+        if (order[i] != i)
+            return 1;
+    }
+    return 0;
+}
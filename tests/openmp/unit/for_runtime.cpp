@@ -0,0 +1,78 @@
+//  Copyright (c) 2018 Tianyi Zhang
+//
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#include <omp.h>
+#include <stdio.h>
+#include <vector>
+
+//every iteration of a schedule(runtime) loop has to run exactly once, with
+// whatever schedule omp_set_schedule picked
+static int run_loop(int n)
+{
+    std::vector<int> count(n, 0);
+    int i;
+#pragma omp parallel for schedule(runtime)
+    for (i = 0; i < n; i++)
+    {
+#pragma omp atomic
+        count[i]++;
+    }
+#pragma omp parallel for schedule(runtime)
+    for (i = n - 1; i >= 0; i -= 3)
+    {
+#pragma omp atomic
+        count[i]++;
+    }
+    for (i = 0; i < n; i++)
+    {
+        if (count[i] != 1 + ((n - 1 - i) % 3 == 0))
+            return 1;
+    }
+    return 0;
+}
+
+int main()
+{
+    omp_sched_t kinds[] = {omp_sched_static, omp_sched_dynamic,
+        omp_sched_guided, omp_sched_auto};
+    int chunks[] = {0, 1, 5};
+
+    for (omp_sched_t kind : kinds)
+    {
+        for (int chunk : chunks)
+        {
+            omp_set_schedule(kind, chunk);
+            omp_sched_t got_kind;
+            int got_chunk;
+            omp_get_schedule(&got_kind, &got_chunk);
+            if (got_kind != kind)
+            {
+                printf("kind %d read back as %d\n", kind, got_kind);
+                return 1;
+            }
+            if (run_loop(1000) != 0)
+            {
+                printf("kind %d, chunk %d failed\n", kind, chunk);
+                return 1;
+            }
+        }
+    }
+
+    //ordered runtime loops stay in order
+    std::vector<int> order;
+    omp_set_schedule(omp_sched_guided, 2);
+#pragma omp parallel for schedule(runtime) ordered
+    for (int i = 0; i < 100; i++)
+    {
+#pragma omp ordered
+        order.push_back(i);
+    }
+    for (int i = 0; i < 100; i++)
+    {
+        if (order[i] != i)
+            return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,44 @@
+//  Copyright (c) 2018 Tianyi Zhang
+//
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#include <omp.h>
+#include <stdio.h>
+#include <vector>
+
+int main()
+{
+    const int n = 2000;
+    std::vector<int> count(n, 0);
+    int i;
+
+    //the first iterations are far more expensive, the threads with the
+    // cheap blocks steal from the others
+#pragma omp parallel for schedule(nonmonotonic: dynamic)
+    for (i = 0; i < n; i++)
+    {
+        volatile int work = 0;
+        for (int j = 0; j < (i < n / 4 ? 10000 : 10); j++)
+            work += j;
+#pragma omp atomic
+        count[i]++;
+    }
+
+#pragma omp parallel for schedule(nonmonotonic: dynamic, 7)
+    for (i = n - 1; i >= 0; i--)
+    {
+#pragma omp atomic
+        count[i]++;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        if (count[i] != 2)
+        {
+            printf("iteration %d ran %d times\n", i, count[i]);
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,86 @@
+// Copyright (c) 2018 Tianyi Zhang
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <omp.h>
+
+// Counts every allocation made through operator new, including the ones of
+// the preloaded runtime, which resolve to the definitions in this executable.
+static std::atomic<long> allocations(0);
+
+void* operator new(std::size_t size)
+{
+    ++allocations;
+    void* p = std::malloc(size ? size : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+int main()
+{
+    int const regions = 1000;
+    int sum = 0;
+
+    // the first regions start the runtime and set up the cached teams of
+    // every size used below
+    for (int i = 0; i < 10; i++)
+    {
+#pragma omp parallel
+        {
+#pragma omp atomic
+            sum += 1;
+        }
+#pragma omp parallel num_threads(2 + i % 2)
+        {
+#pragma omp atomic
+            sum += 1;
+        }
+    }
+
+    long before = allocations.load();
+    for (int i = 0; i < regions; i++)
+    {
+#pragma omp parallel
+        {
+#pragma omp atomic
+            sum += 1;
+        }
+    }
+    // alternating team sizes at the same depth
+    for (int i = 0; i < regions; i++)
+    {
+#pragma omp parallel num_threads(2 + i % 2)
+        {
+#pragma omp atomic
+            sum += 1;
+        }
+    }
+    long steady = allocations.load() - before;
+
+    // steady state fork/join does not allocate. The bound only leaves room
+    // for HPX growing its own scheduler queues once or twice, a fork that
+    // allocates shows up here once per region.
+    if (steady > 16)
+    {
+        std::cout << steady << " allocations in " << 2 * regions
+                  << " regions" << std::endl;
+        return 1;
+    }
+    return 0;
+}
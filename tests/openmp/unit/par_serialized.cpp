@@ -0,0 +1,59 @@
+// Copyright (c) 2018 Tianyi Zhang
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#include <iostream>
+#include <omp.h>
+
+int main()
+{
+    int num_threads = 0;
+    int thread_num = -1;
+    int count = 0;
+
+#pragma omp parallel if (0)
+    {
+        num_threads = omp_get_num_threads();
+        thread_num = omp_get_thread_num();
+#pragma omp single
+        count++;
+#pragma omp critical
+        count++;
+#pragma omp barrier
+#pragma omp task
+        count++;
+#pragma omp taskwait
+    }
+    if (num_threads != 1 || thread_num != 0 || count != 3)
+        return 1;
+
+    // teams of one nested in a real team keep the outer thread numbers intact
+    int wrong = 0;
+#pragma omp parallel
+    {
+        int outer = omp_get_thread_num();
+#pragma omp parallel num_threads(1)
+        {
+            if (omp_get_num_threads() != 1 || omp_get_thread_num() != 0)
+            {
+#pragma omp atomic
+                wrong++;
+            }
+        }
+        if (omp_get_thread_num() != outer)
+        {
+#pragma omp atomic
+            wrong++;
+        }
+    }
+    if (wrong != 0)
+        return 1;
+
+    int sum = 0;
+#pragma omp parallel num_threads(1) reduction(+ : sum)
+    sum += 5;
+    if (sum != 5)
+        return 1;
+    return 0;
+}
@@ -0,0 +1,46 @@
+//  Copyright (c) 2018 Tianyi Zhang
+//
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#include <stdio.h>
+#include <unistd.h>
+#include <omp.h>
+
+#define READERS 8
+
+int main()
+{
+    int errors = 0;
+    for (int round = 0; round < 50; round++) {
+        int x = 1;
+        int seen[READERS];
+#pragma omp parallel
+        {
+#pragma omp single
+            {
+                for (int r = 0; r < READERS; r++) {
+                    //the writer below has to wait for every reader
+#pragma omp task depend(in : x) shared(x, seen)
+                    {
+                        usleep(100);
+                        seen[r] = x;
+                    }
+                }
+#pragma omp task depend(out : x) shared(x)
+                x = 2;
+
+#pragma omp task depend(inout : x) shared(x)
+                x *= 3;
+            }
+        }
+        for (int r = 0; r < READERS; r++) {
+            if (seen[r] != 1)
+                errors++;
+        }
+        if (x != 6)
+            errors++;
+    }
+    printf("errors = %d\n", errors);
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,40 @@
+//  Copyright (c) 2018 Tianyi Zhang
+//
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#include <omp.h>
+#include <stdio.h>
+
+int main()
+{
+    int if0_runs = 0, included = 0, in_final = 0, not_final = 0;
+#pragma omp parallel
+    {
+#pragma omp single
+        {
+            //an undeferred task runs exactly once, before the parent goes on
+#pragma omp task if(0) shared(if0_runs)
+            if0_runs++;
+
+#pragma omp task final(1) shared(included, in_final)
+            {
+                in_final = omp_in_final();
+                for (int i = 0; i < 10; i++) {
+                    //included tasks, done when the loop moves on
+#pragma omp task shared(included)
+                    included++;
+                }
+            }
+#pragma omp taskwait
+            not_final = !omp_in_final();
+        }
+    }
+    printf("if0 runs = %d, included = %d, in final = %d\n",
+           if0_runs, included, in_final);
+    if (if0_runs != 1 || included != 10 || !in_final || !not_final)
+        return 1;
+    if (omp_get_max_task_priority() < 0)
+        return 1;
+    return 0;
+}
@@ -0,0 +1,41 @@
+//  Copyright (c) 2018 Tianyi Zhang
+//
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#include <stdio.h>
+#include <unistd.h>
+#include <omp.h>
+
+int main()
+{
+    int errors = 0;
+    for (int round = 0; round < 20; round++) {
+        int x = 0, y = 0, seen_x = -1, seen_y = -1;
+#pragma omp parallel
+        {
+#pragma omp single
+            {
+#pragma omp task depend(out : x) shared(x)
+                {
+                    usleep(1000);
+                    x = 1;
+                }
+#pragma omp task depend(out : y) shared(y)
+                {
+                    usleep(1000);
+                    y = 1;
+                }
+                //waits for the writer of x only
+#pragma omp task if(0) depend(in : x) shared(x, seen_x)
+                seen_x = x;
+#pragma omp taskwait
+                seen_y = y;
+            }
+        }
+        if (seen_x != 1 || seen_y != 1)
+            errors++;
+    }
+    printf("errors = %d\n", errors);
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,71 @@
+//  Copyright (c) 2018 Tianyi Zhang
+//
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#include <omp.h>
+#include <stdio.h>
+#include <unistd.h>
+
+int main()
+{
+    int sum = 0;
+    int errors = 0;
+#pragma omp parallel
+    {
+#pragma omp single
+        {
+            //GOMP_task with the priority flag
+            for (int i = 0; i < 10; i++)
+            {
+#pragma omp task priority(1) shared(sum)
+                {
+#pragma omp atomic
+                    sum++;
+                }
+            }
+            //priority 0 stays at normal priority
+            for (int i = 0; i < 10; i++)
+            {
+#pragma omp task priority(0) shared(sum)
+                {
+#pragma omp atomic
+                    sum++;
+                }
+            }
+            //GOMP_taskloop with the priority flag
+#pragma omp taskloop priority(1) num_tasks(4) shared(sum)
+            for (int i = 0; i < 100; i++)
+            {
+#pragma omp atomic
+                sum++;
+            }
+#pragma omp taskwait
+
+            //with both the priority and the depend flag the dependences
+            // still come from the right argument
+            for (int round = 0; round < 20; round++)
+            {
+                int x = 0;
+#pragma omp task priority(1) depend(out : x) shared(x)
+                {
+                    usleep(100);
+                    x = round + 1;
+                }
+#pragma omp task priority(1) depend(in : x) shared(x, errors)
+                {
+                    if (x != round + 1)
+                    {
+#pragma omp atomic
+                        errors++;
+                    }
+                }
+#pragma omp taskwait
+            }
+        }
+    }
+    printf("sum = %d, errors = %d\n", sum, errors);
+    if (sum != 120 || errors != 0)
+        return 1;
+    return 0;
+}
@@ -0,0 +1,37 @@
+//  Copyright (c) 2018 Tianyi Zhang
+//
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#include <iostream>
+
+int main(int argc, char **argv)
+{
+    long outer = 0, inner = 0;
+#pragma omp parallel
+#pragma omp single
+    {
+    #pragma omp taskgroup task_reduction(+:outer)
+        {
+            for (int i = 0; i < 1000; i++) {
+            #pragma omp task in_reduction(+:outer)
+                outer += i;
+            }
+            //the inner taskgroup must not hide the outer one
+        #pragma omp taskgroup task_reduction(+:inner)
+            {
+                for (int i = 0; i < 1000; i++) {
+                #pragma omp task in_reduction(+:outer, inner)
+                    {
+                        outer += 1;
+                        inner += 2;
+                    }
+                }
+            }
+        }
+        std::cout<<outer<<" "<<inner<<std::endl;
+    }
+    if(outer != 999 * 1000 / 2 + 1000 || inner != 2000)
+        return 1;
+    return 0;
+}
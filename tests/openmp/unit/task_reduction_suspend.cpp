@@ -0,0 +1,36 @@
+//  Copyright (c) 2018 Tianyi Zhang
+//
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#include <iostream>
+
+//tasks that wait for children while they hold a private copy, the hpx thread
+// may resume on another worker and keeps its copy
+int main(int argc, char **argv)
+{
+    long sum = 0;
+#pragma omp parallel
+#pragma omp single
+    {
+    #pragma omp taskgroup task_reduction(+:sum)
+        {
+            for (int i = 0; i < 200; i++) {
+            #pragma omp task in_reduction(+:sum)
+                {
+                    sum += 1;
+                    for (int j = 0; j < 10; j++) {
+                    #pragma omp task in_reduction(+:sum)
+                        sum += 2;
+                    }
+                #pragma omp taskwait
+                    sum += 1;
+                }
+            }
+        }
+        std::cout<<sum<<std::endl;
+    }
+    if(sum != 200 * 22)
+        return 1;
+    return 0;
+}
@@ -0,0 +1,74 @@
+//  Copyright (c) 2018 Tianyi Zhang
+//
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#include <stdio.h>
+#include <unistd.h>
+#include <omp.h>
+
+//the entry points of taskgraph regions, called the way the compiler would.
+// Resolved from the preloaded library, the OpenMP runtime the test links
+// against may not have them.
+extern "C" __attribute__((weak)) int __kmpc_start_record_task(void *loc, int gtid,
+                                                               int flags, int tdg_id);
+extern "C" __attribute__((weak)) void __kmpc_end_record_task(void *loc, int gtid,
+                                                              int flags, int tdg_id);
+
+//the first round records the region, the later ones replay it
+static int run_rounds(int num_threads, int tdg_id)
+{
+    int const nowait = 1;
+    int errors = 0;
+    int x = 0, y = 0, result = 0;
+    for (int round = 1; round <= 5; round++)
+    {
+#pragma omp parallel num_threads(num_threads)
+        {
+#pragma omp single
+            {
+                //created before the region, the replayed reader waits for it
+#pragma omp task depend(out : x) shared(x)
+                {
+                    usleep(10000);
+                    x = round;
+                }
+                int gtid = omp_get_thread_num();
+                if (__kmpc_start_record_task(nullptr, gtid, nowait, tdg_id))
+                {
+#pragma omp task depend(in : x) depend(out : y) shared(x, y)
+                    {
+                        usleep(1000);
+                        y = 10 * x;
+                    }
+                }
+                __kmpc_end_record_task(nullptr, gtid, nowait, tdg_id);
+                //created after the region, waits for the replayed writer
+#pragma omp task depend(in : y) shared(y, result)
+                {
+                    result = y;
+                }
+            }
+        }
+        if (result != 10 * round)
+        {
+            printf("%d threads, round %d: %d instead of %d\n", num_threads,
+                   round, result, 10 * round);
+            errors++;
+        }
+    }
+    return errors;
+}
+
+int main()
+{
+    if (!__kmpc_start_record_task || !__kmpc_end_record_task)
+    {
+        printf("not running on hpxMP\n");
+        return 1;
+    }
+    int errors = run_rounds(omp_get_max_threads(), 1);
+    //a team of one replays the graph inline
+    errors += run_rounds(1, 2);
+    return errors != 0;
+}
@@ -0,0 +1,44 @@
+//  Copyright (c) 2018 Tianyi Zhang
+//
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#include <omp.h>
+#include <stdio.h>
+
+#define N 1000
+
+int main()
+{
+    int a[N];
+    int last = -1;
+    for (int i = 0; i < N; i++)
+        a[i] = 0;
+#pragma omp parallel
+    {
+#pragma omp single
+        {
+#pragma omp taskloop grainsize(7)
+            for (int i = 0; i < N; i++)
+                a[i] += 1;
+
+#pragma omp taskloop num_tasks(13)
+            for (int i = N - 1; i >= 0; i -= 2)
+                a[i] += 2;
+
+            //only the task running the last chunk writes back
+#pragma omp taskloop lastprivate(last)
+            for (int i = 0; i < N; i++)
+                last = i;
+        }
+    }
+    int errors = 0;
+    for (int i = 0; i < N; i++) {
+        if (a[i] != (i % 2 ? 3 : 1))
+            errors++;
+    }
+    printf("errors = %d, last = %d\n", errors, last);
+    if (errors || last != N - 1)
+        return 1;
+    return 0;
+}